@@ -0,0 +1,1176 @@
+/*
+ * Benchmark of the component layer and the flush pipeline, run against the
+ * fixture files under ROOT_PREFIX rather than the real procfs and sysfs.
+ * Built and run by ‘make bench’.
+ *
+ * Each component is updated repeatedly and timed, then the same updates
+ * are repeated in a child traced with ptrace to count system calls.
+ * Allocations are counted by wrapping the allocator.  The parsers of
+ * procfs text are timed against the sscanf() and strtok_r() code they
+ * replaced, the per-core CPU usage kernels are timed on synthetic
+ * /proc/stat text, and text is
+ * published by many writers at once while a flusher reads it.  Commands
+ * are run with util_run_cmd() and with fork(), at several sizes of the
+ * process.
+ *
+ * After the timings, checks of behaviour that would not show up in them,
+ * e.g. that a blocked update does not hold up the others, are run, and the
+ * benchmark fails if any of them does not pass.
+ */
+#define main mtstatus_main
+#include "../mtstatus.c"
+#undef main
+
+#include "../cpustat.h"
+#include "../parse.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS 20000
+#define TRACED_ITERATIONS  200
+#define NO_PHASE	   UINT_MAX
+
+static const unsigned bench_cores[] = { 4, 64, 512 };
+
+typedef struct {
+	const char *name;
+	SBarUpdater update;
+	const char *args;
+} BenchComp;
+
+static const BenchComp bench_comps[] = {
+	{ "keyboard", comp_keyboard_indicator, NULL },
+	{ "net_traffic", comp_net_traffic, "lo" },
+	{ "net_spark", comp_net_traffic, "lo spark" },
+	{ "cpu", comp_cpu, NULL },
+	{ "cpu_spark", comp_cpu, "spark" },
+	{ "cpu_cores", comp_cpu_cores, NULL },
+	{ "memory", comp_memory_available, NULL },
+	{ "disk_free", comp_disk_free, "/" },
+	{ "wifi", comp_wifi, "wlan0" },
+	{ "battery", comp_battery, NULL },
+	{ "datetime", comp_datetime, "%a %e %b %R" },
+};
+
+#define NCOMPS	 LEN(bench_comps)
+#define PIPELINE NCOMPS	 // phase of the full update and flush pipeline
+
+typedef struct {
+	int64_t p50, p99, max;	// update latency in ns
+	double allocs;		// allocations per update
+	double syscalls;	// system calls per update
+} Result;
+
+static unsigned long nallocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	nallocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nallocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static StatusBar bench_sbar;
+
+static void bench_sbar_create(void)
+{
+	static ComponentDefn defns[NCOMPS];
+
+	for (size_t i = 0; i < NCOMPS; i++) {
+		const ComponentDefn d = { .name = bench_comps[i].name,
+					  .update = bench_comps[i].update,
+					  .args = bench_comps[i].args,
+					  .interval = 1,
+					  .signum = -1 };
+		memcpy(&defns[i], &d, sizeof(d));
+	}
+	to_stdout = true;
+	sbar_create(&bench_sbar, NCOMPS, defns);
+}
+
+/*
+ * Run one update of phase ‘phase’: a single component, or every component
+ * followed by a flush and output of the status.
+ */
+static void bench_step(unsigned phase)
+{
+	char buf[MAX_COMP_LEN] = "";
+
+	if (phase < NCOMPS) {
+		bench_comps[phase].update(buf, sizeof(buf),
+					  bench_comps[phase].args,
+					  bench_sbar.components[phase].state);
+		return;
+	}
+	for (uint8_t i = 0; i < bench_sbar.ncomponents; i++)
+		sbar_comp_update(&bench_sbar.components[i]);
+	if (sbar_flush(&bench_sbar))
+		sbar_output(bench_sbar.status);
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_time(unsigned phase, unsigned n, int64_t *lat,
+		       Result *res)
+{
+	unsigned long allocs;
+	int64_t t;
+
+	/* Warm up source caches and sockets before measuring */
+	bench_step(phase);
+	allocs = nallocs;
+	for (unsigned k = 0; k < n; k++) {
+		t = now_ns();
+		bench_step(phase);
+		lat[k] = now_ns() - t;
+	}
+	res->allocs = (double)(nallocs - allocs) / n;
+	qsort(lat, n, sizeof(*lat), cmp_i64);
+	res->p50 = lat[n / 2];
+	res->p99 = lat[(size_t)n * 99 / 100];
+	res->max = lat[n - 1];
+}
+
+/*
+ * Count the system calls made per update of each phase, by running the
+ * phases in a traced child.  The child publishes the phase it is in
+ * through shared memory, and the parent charges each system call entry to
+ * that phase.  Returns false if tracing is not permitted.
+ */
+static bool bench_count_syscalls(unsigned n, Result *res)
+{
+	unsigned long counts[NCOMPS + 1] = { 0 };
+	volatile unsigned *phase;
+	bool entry = false;
+	int status;
+	pid_t pid;
+
+	phase = mmap(NULL, sizeof(*phase), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (phase == MAP_FAILED)
+		fatal(errno);
+	*phase = NO_PHASE;
+
+	pid = fork();
+	if (pid < 0)
+		fatal(errno);
+	if (pid == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			_exit(EXIT_FAILURE);
+		(void)raise(SIGSTOP);
+		for (unsigned p = 0; p <= PIPELINE; p++) {
+			bench_step(p);
+			*phase = p;
+			for (unsigned k = 0; k < n; k++)
+				bench_step(p);
+			*phase = NO_PHASE;
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		fatal(errno);
+	if (!WIFSTOPPED(status))
+		return false;
+	if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		   (void *)(uintptr_t)PTRACE_O_TRACESYSGOOD) < 0)
+		fatal(errno);
+	while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0) {
+		if (waitpid(pid, &status, 0) < 0)
+			fatal(errno);
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+		if (WSTOPSIG(status) != (SIGTRAP | 0x80))
+			continue;
+		/* Stops alternate between entry to and exit from a call */
+		entry = !entry;
+		if (entry && *phase != NO_PHASE)
+			counts[*phase]++;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		return false;
+
+	for (unsigned p = 0; p <= PIPELINE; p++)
+		res[p].syscalls = (double)counts[p] / n;
+	return true;
+}
+
+/*
+ * Find the line containing ‘key’, and parse its ‘field’th (1-based) field,
+ * the way comp_memory_available() and comp_wifi() did before the in-place
+ * parsers: a strstr() search of each line, a copy of the line to the heap,
+ * strtok_r() and strtoul().  The search writes into the text, so it works
+ * on a copy of it, as it did on the buffer of each read.
+ */
+static bool old_line_field(const char *text, const char *key, int field,
+			   uint64_t *val)
+{
+	char contents[4096], *line = contents, *end, *found = NULL, *tok, *save;
+	size_t len;
+	bool last;
+
+	(void)snprintf(contents, sizeof(contents), "%s", text);
+	for (last = false; *line && !last && !found; line = end + 1) {
+		end = strchrnul(line, '\n');
+		last = *end == '\0';
+		*end = '\0';
+		if (strstr(line, key)) {
+			len = (size_t)(end - line) + 1;
+			found = malloc(len);
+			if (!found)
+				fatal(errno);
+			memcpy(found, line, len);
+		}
+	}
+	if (!found)
+		return false;
+	tok = strtok_r(found, " ", &save);
+	while (tok && --field > 0)
+		tok = strtok_r(NULL, " ", &save);
+	if (tok)
+		*val = strtoul(tok, NULL, 0);
+	free(found);
+	return tok;
+}
+
+static bool new_stat(const char *text, uint64_t *val)
+{
+	const char *line = parse_line(text, "cpu ");
+	uint64_t t[7];
+
+	if (!line || parse_u64s(line, t, LEN(t)) != LEN(t))
+		return false;
+	*val = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6];
+	return true;
+}
+
+static bool old_stat(const char *text, uint64_t *val)
+{
+	uint64_t t[7];
+
+	if (sscanf(text, "cpu  %lu %lu %lu %lu %lu %lu %lu", &t[0], &t[1],
+		   &t[2], &t[3], &t[4], &t[5], &t[6]) != LEN(t))
+		return false;
+	*val = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6];
+	return true;
+}
+
+static bool new_meminfo(const char *text, uint64_t *val)
+{
+	const char *line = parse_line(text, "MemAvailable:");
+
+	return line && parse_u64(line, val);
+}
+
+static bool old_meminfo(const char *text, uint64_t *val)
+{
+	return old_line_field(text, "MemAvailable", 2, val);
+}
+
+static bool new_wireless(const char *text, uint64_t *val)
+{
+	const char *line = parse_line(text, "wlan0:");
+
+	line = line ? parse_field(line, 2) : NULL;
+	return line && parse_u64(line, val);
+}
+
+static bool old_wireless(const char *text, uint64_t *val)
+{
+	return old_line_field(text, "wlan0", 3, val);
+}
+
+typedef bool (*ParseFn)(const char *text, uint64_t *val);
+
+typedef struct {
+	const char *path;
+	ParseFn parse, old;
+} ParseCase;
+
+static const ParseCase parse_cases[] = {
+	{ ROOT_PREFIX "/proc/stat", new_stat, old_stat },
+	{ ROOT_PREFIX "/proc/meminfo", new_meminfo, old_meminfo },
+	{ ROOT_PREFIX "/proc/net/wireless", new_wireless, old_wireless },
+};
+
+/*
+ * Time ‘n’ runs of ‘fn’ on ‘text’, and return the mean time per run in ns
+ * and the allocations per run in ‘allocs’.
+ */
+static double bench_parse_fn(ParseFn fn, const char *text, unsigned n,
+			     uint64_t *val, double *allocs)
+{
+	const unsigned long a = nallocs;
+	int64_t t = now_ns();
+
+	for (unsigned k = 0; k < n; k++)
+		if (!fn(text, val))
+			fatal(EINVAL);
+	t = now_ns() - t;
+	*allocs = (double)(nallocs - a) / n;
+	return (double)t / n;
+}
+
+/*
+ * Time the in-place parsers against the code they replaced on each of the
+ * fixture files, checking that both find the same value.
+ */
+static void bench_parsers(unsigned n)
+{
+	static char text[4096];
+	uint64_t val, old_val;
+	double ns, old_ns, allocs, old_allocs;
+	const char *name;
+
+	printf("\n%-12s %10s %7s %10s %7s\n", "file", "parse ns", "allocs",
+	       "old ns", "allocs");
+	for (size_t i = 0; i < LEN(parse_cases); i++) {
+		if (util_source_read(parse_cases[i].path, text,
+				     sizeof(text)) < 0)
+			fatal(errno);
+		ns = bench_parse_fn(parse_cases[i].parse, text, n, &val,
+				    &allocs);
+		old_ns = bench_parse_fn(parse_cases[i].old, text, n, &old_val,
+					&old_allocs);
+		name = parse_cases[i].path + sizeof(ROOT_PREFIX "/proc/") - 1;
+		printf("%-12s %10.1f %7.2f %10.1f %7.2f%s\n", name, ns, allocs,
+		       old_ns, old_allocs, val == old_val ? "" : " (differs)");
+	}
+}
+
+/*
+ * Write /proc/stat text for ‘ncores’ cores into ‘buf’, with times that
+ * advance by a different amount for each core and ‘round’.
+ */
+static void bench_stat(char *buf, const char *end, unsigned ncores,
+		       unsigned round)
+{
+	char line[128];
+
+	buf = util_cat(buf, end, "cpu  1 2 3 4 5 6 7 8 9 10\n");
+	for (unsigned i = 0; i < ncores; i++) {
+		const uint64_t b = (uint64_t)round * (100 + i % 97);
+		(void)snprintf(line, sizeof(line),
+			       "cpu%u %" PRIu64 " %" PRIu64 " %" PRIu64
+			       " %" PRIu64 " 5 0 %" PRIu64 " 0 0 0\n",
+			       i, 4000000 + b * (i % 7), 2000 + b / 50,
+			       1000000 + b, 70000000 + b * 9, 30000 + b / 9);
+		buf = util_cat(buf, end, line);
+	}
+	buf = util_cat(buf, end, "intr 1 2 3\nctxt 1\n");
+	*buf = '\0';
+}
+
+/*
+ * Time ‘n’ runs of a per-core usage kernel on alternating CpuTimes, and
+ * return the mean time per run in ns.
+ */
+static double bench_kernel(CpuUsageFn fn, const CpuTimes *a,
+			   const CpuTimes *b, unsigned n, float *usage)
+{
+	static CpuTimes prev;
+	int64_t t = now_ns();
+
+	for (unsigned k = 0; k < n; k++)
+		fn(k & 1 ? b : a, &prev, usage);
+	return (double)(now_ns() - t) / n;
+}
+
+/*
+ * Time parsing and the usage kernels at each of ‘bench_cores’, checking
+ * that the vector kernels agree with the scalar one.
+ */
+static void bench_cpu_cores(unsigned n)
+{
+	static char stat[2][CPUSTAT_MAX_CORES * 128];
+	static CpuTimes times[2];
+	static float usage[CPUSTAT_MAX_CORES], expect[CPUSTAT_MAX_CORES];
+	static CpuTimes prev;
+	double parse;
+	int64_t t;
+
+	printf("\n%-6s %10s %10s %10s %10s\n", "cores", "parse ns",
+	       "scalar ns", "sse2 ns", "avx2 ns");
+	for (size_t c = 0; c < LEN(bench_cores); c++) {
+		for (unsigned k = 0; k < 2; k++)
+			bench_stat(stat[k], stat[k] + sizeof(stat[k]) - 1,
+				   bench_cores[c], k + 1);
+		t = now_ns();
+		for (unsigned k = 0; k < n; k++)
+			cpustat_parse(stat[k & 1], &times[k & 1]);
+		parse = (double)(now_ns() - t) / n;
+
+		printf("%-6u %10.0f %10.1f", bench_cores[c], parse,
+		       bench_kernel(cpustat_usage_scalar, &times[0],
+				    &times[1], n, usage));
+		cpustat_usage_scalar(&times[0], &prev, expect);
+		cpustat_usage_scalar(&times[1], &prev, expect);
+#if defined(__x86_64__)
+		printf(" %10.1f", bench_kernel(cpustat_usage_sse2, &times[0],
+					       &times[1], n, usage));
+		cpustat_usage_sse2(&times[0], &prev, usage);
+		cpustat_usage_sse2(&times[1], &prev, usage);
+		if (memcmp(usage, expect, times[1].n * sizeof(*usage)) != 0)
+			printf(" (differs)");
+		if (__builtin_cpu_supports("avx2")) {
+			printf(" %10.1f",
+			       bench_kernel(cpustat_usage_avx2, &times[0],
+					    &times[1], n, usage));
+			cpustat_usage_avx2(&times[0], &prev, usage);
+			cpustat_usage_avx2(&times[1], &prev, usage);
+			if (memcmp(usage, expect,
+				   times[1].n * sizeof(*usage)) != 0)
+				printf(" (differs)");
+		} else {
+			printf(" %10s", "n/a");
+		}
+#else
+		printf(" %10s %10s", "n/a", "n/a");
+#endif
+		printf("\n");
+	}
+}
+
+/* Runs of a command at each size of the process */
+#define SPAWN_RUNS 50
+
+/* Memory touched before timing commands, in MiB */
+static const size_t spawn_rss_mib[] = { 0, 256, 1024 };
+
+/*
+ * Run ‘argv’ and read the first line of its output the way util_run_cmd()
+ * did before it used posix_spawn(): fork(), execvp() and a blocking read.
+ */
+static bool fork_cmd(char *buf, const size_t bufsize, char *const argv[])
+{
+	int pipefd[2], status;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(pipefd) < 0)
+		return false;
+	pid = fork();
+	if (pid < 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return false;
+	}
+	if (pid == 0) {
+		if (dup2(pipefd[1], STDOUT_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		execvp(argv[0], argv);
+		_exit(EXIT_FAILURE);
+	}
+	close(pipefd[1]);
+	n = read(pipefd[0], buf, bufsize - 1);
+	buf[n > 0 ? n : 0] = '\0';
+	close(pipefd[0]);
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	       WEXITSTATUS(status) == 0;
+}
+
+/* Return the median time in ns of SPAWN_RUNS runs of ‘argv’ */
+static int64_t bench_run(bool spawn, char *const argv[])
+{
+	int64_t lat[SPAWN_RUNS], t;
+	char buf[MAX_COMP_LEN];
+
+	for (unsigned k = 0; k < SPAWN_RUNS; k++) {
+		t = now_ns();
+		if (spawn ? !util_run_cmd(buf, sizeof(buf), argv, 1000)
+			  : !fork_cmd(buf, sizeof(buf), argv))
+			fatal(ECHILD);
+		lat[k] = now_ns() - t;
+	}
+	qsort(lat, SPAWN_RUNS, sizeof(*lat), cmp_i64);
+	return lat[SPAWN_RUNS / 2];
+}
+
+/*
+ * Time running a command through fork() and through util_run_cmd() with
+ * each of ‘spawn_rss_mib’ more memory touched, as fork() copies the page
+ * tables of all of it.
+ */
+static void bench_spawn(void)
+{
+	char *const argv[] = { "true", NULL };
+	const long page = sysconf(_SC_PAGESIZE);
+	size_t size;
+	char *mem;
+
+	printf("\n%-10s %10s %10s\n", "+RSS MiB", "fork ms", "spawn ms");
+	for (size_t i = 0; i < LEN(spawn_rss_mib); i++) {
+		size = spawn_rss_mib[i] << 20;
+		mem = NULL;
+		if (size) {
+			mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED) {
+				printf("%-10zu %10s %10s\n", spawn_rss_mib[i],
+				       "n/a", "n/a");
+				continue;
+			}
+			for (size_t off = 0; off < size; off += (size_t)page)
+				mem[off] = 1;
+		}
+		printf("%-10zu %10.2f", spawn_rss_mib[i],
+		       (double)bench_run(false, argv) / 1e6);
+		printf(" %10.2f\n", (double)bench_run(true, argv) / 1e6);
+		if (mem)
+			munmap(mem, size);
+	}
+}
+
+/* Synthetic components updated by each writer thread of the stress test */
+#define STRESS_COMPONENTS 200
+#define STRESS_WRITERS	  4
+#define STRESS_UPDATES	  200000  // per writer
+
+typedef struct {
+	unsigned first, n;  // the writer's components
+	int64_t *lat;	    // publication latency of each update in ns
+	long nvcsw;	    // voluntary context switches, i.e. times it blocked
+} StressWriter;
+
+static StatusBar stress_sbar;
+static atomic_bool stress_done;
+static unsigned long stress_frames, stress_torn;
+static long stress_nvcsw;
+
+/*
+ * Write the next letter after the current text's, repeated a number of
+ * times that depends on the letter, so that text torn between two updates
+ * has either mixed letters or the wrong length.
+ */
+static void stress_update(char *buf, const size_t bufsize, const char *args,
+			  void *state)
+{
+	const char c = buf[0] >= 'a' && buf[0] < 'z' ? buf[0] + 1 : 'a';
+	const size_t len = 10 + (size_t)(c - 'a');
+
+	memset(buf, c, len);
+	buf[len] = '\0';
+}
+
+/* Whether ‘seg’ of ‘len’ bytes is text that stress_update() wrote */
+static bool stress_whole(const char *seg, size_t len)
+{
+	if (len == sizeof(no_val_str) - 1 &&
+	    memcmp(seg, no_val_str, len) == 0)
+		return true;
+	if (seg[0] < 'a' || seg[0] > 'z' || len != 10 + (size_t)(seg[0] - 'a'))
+		return false;
+	for (size_t k = 1; k < len; k++)
+		if (seg[k] != seg[0])
+			return false;
+	return true;
+}
+
+static void *stress_write(void *arg)
+{
+	StressWriter *w = arg;
+	struct rusage ru;
+	Component *c;
+	int64_t t;
+	long nvcsw;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		fatal(errno);
+	nvcsw = ru.ru_nvcsw;
+	for (unsigned k = 0; k < STRESS_UPDATES; k++) {
+		c = &stress_sbar.components[w->first + k % w->n];
+		t = now_ns();
+		sbar_comp_update(c);
+		w->lat[k] = now_ns() - t;
+	}
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		fatal(errno);
+	w->nvcsw = ru.ru_nvcsw - nvcsw;
+	return NULL;
+}
+
+/*
+ * Flush the status until the writers are done, checking that every
+ * component's segment of it is whole.
+ */
+static void *stress_flush(void *arg)
+{
+	const char *seg, *end;
+
+	while (!atomic_load(&stress_done)) {
+		if (!sbar_flush(&stress_sbar))
+			continue;
+		stress_frames++;
+		for (seg = stress_sbar.status; *seg; seg = end) {
+			end = strchrnul(seg, ' ');
+			if (end > seg && !stress_whole(seg, (size_t)(end - seg)))
+				stress_torn++;
+			while (*end == ' ')
+				end++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Publish text from STRESS_WRITERS threads, each updating its own share of
+ * STRESS_COMPONENTS components as fast as it can, while another thread
+ * flushes the status.  Reports the latency of an update including its
+ * publication, and counts torn text and times a writer blocked.
+ */
+static void bench_contention(void)
+{
+	static ComponentDefn defns[STRESS_COMPONENTS];
+	static StressWriter writers[STRESS_WRITERS];
+	static int64_t lat[STRESS_WRITERS * STRESS_UPDATES];
+	const unsigned share = STRESS_COMPONENTS / STRESS_WRITERS;
+	const size_t n = LEN(lat);
+	pthread_t tids[STRESS_WRITERS], flusher;
+	int64_t t;
+	int r;
+
+	for (size_t i = 0; i < STRESS_COMPONENTS; i++) {
+		const ComponentDefn d = { .update = stress_update,
+					  .interval = 1,
+					  .signum = -1 };
+		memcpy(&defns[i], &d, sizeof(d));
+	}
+	sbar_create(&stress_sbar, STRESS_COMPONENTS, defns);
+
+	if ((r = pthread_create(&flusher, NULL, stress_flush, NULL)))
+		fatal(r);
+	t = now_ns();
+	for (unsigned w = 0; w < STRESS_WRITERS; w++) {
+		writers[w] = (StressWriter){ .first = w * share,
+					     .n = share,
+					     .lat = lat + w * STRESS_UPDATES };
+		if ((r = pthread_create(&tids[w], NULL, stress_write,
+					&writers[w])))
+			fatal(r);
+	}
+	for (unsigned w = 0; w < STRESS_WRITERS; w++) {
+		if ((r = pthread_join(tids[w], NULL)))
+			fatal(r);
+		stress_nvcsw += writers[w].nvcsw;
+	}
+	t = now_ns() - t;
+	atomic_store(&stress_done, true);
+	if ((r = pthread_join(flusher, NULL)))
+		fatal(r);
+
+	qsort(lat, n, sizeof(*lat), cmp_i64);
+	printf("\n%-10s %8s %8s %8s %10s %8s %8s\n", "writers", "p50 ns",
+	       "p99 ns", "max ns", "updates/s", "frames", "torn");
+	printf("%-10u %8" PRId64 " %8" PRId64 " %8" PRId64 " %10.0f %8lu "
+	       "%8lu\n",
+	       STRESS_WRITERS, lat[n / 2], lat[n * 99 / 100], lat[n - 1],
+	       (double)n * 1e9 / (double)t, stress_frames, stress_torn);
+}
+
+/* Check that the flusher never saw text torn by a concurrent update */
+static bool check_torn(void)
+{
+	return stress_frames > 0 && stress_torn == 0;
+}
+
+/* Check that no writer blocked, e.g. waiting on the flusher */
+static bool check_writers_blocked(void)
+{
+	return stress_nvcsw == 0;
+}
+
+/* Time a check allows for what should happen at once */
+#define CHECK_TIMEOUT_MS 2000
+
+/*
+ * Wait until ‘flag’ is ‘value’, for up to CHECK_TIMEOUT_MS, and return
+ * whether it is.
+ */
+static bool check_wait(atomic_bool *flag, bool value)
+{
+	const struct timespec tick = { .tv_nsec = 1000000 };
+
+	for (unsigned ms = 0; ms < CHECK_TIMEOUT_MS; ms++) {
+		if (atomic_load(flag) == value)
+			return true;
+		(void)nanosleep(&tick, NULL);
+	}
+	return atomic_load(flag) == value;
+}
+
+static char hung_path[PATH_MAX];
+static atomic_bool hung_overdue;
+
+static void hung_run(PoolJob *j)
+{
+	char buf[64];
+
+	(void)util_source_read(hung_path, buf, sizeof(buf));
+}
+
+static void hung_set_overdue(PoolJob *j, bool overdue)
+{
+	atomic_store(&hung_overdue, overdue);
+}
+
+static void *check_inline_read(void *arg)
+{
+	char buf[4096];
+
+	return (void *)(uintptr_t)(util_source_read(ROOT_PREFIX "/proc/stat",
+						    buf, sizeof(buf)) > 0);
+}
+
+/*
+ * Check that a source read stuck on the worker pool, here a FIFO that
+ * nothing writes, does not hold up reads of other sources outside it.
+ */
+static bool check_hung_source(void)
+{
+	static Pool pool;
+	static PoolJob job = { .run = hung_run,
+			       .overdue = hung_set_overdue,
+			       .budget_ns = 100000000 };
+	char dir[] = "/tmp/mtstatus-bench-XXXXXX";
+	struct timespec until;
+	void *read = NULL;
+	pthread_t tid;
+	bool ok;
+	int fd, r;
+
+	if (!mkdtemp(dir))
+		fatal(errno);
+	(void)snprintf(hung_path, sizeof(hung_path), "%s/fifo", dir);
+	if (mkfifo(hung_path, 0600) < 0)
+		fatal(errno);
+	if ((r = pool_start(&pool, 1)))
+		fatal(r);
+	(void)pool_submit(&pool, &job);
+	ok = check_wait(&hung_overdue, true);
+
+	if ((r = pthread_create(&tid, NULL, check_inline_read, NULL)))
+		fatal(r);
+	if (clock_gettime(CLOCK_REALTIME, &until) < 0)
+		fatal(errno);
+	until.tv_sec += CHECK_TIMEOUT_MS / 1000;
+	r = pthread_timedjoin_np(tid, &read, &until);
+	ok = ok && r == 0 && read;
+
+	/* Opening the FIFO for writing lets the stuck open() return, and
+	   closing it makes the read see end of file */
+	fd = open(hung_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd >= 0)
+		close(fd);
+	ok = check_wait(&hung_overdue, false) && ok;
+	(void)unlink(hung_path);
+	(void)rmdir(dir);
+	if (r != 0) {
+		/* The reader is still stuck and would never be joined */
+		printf("%-28s FAILED\n", "hung source");
+		exit(EXIT_FAILURE);
+	}
+	return ok;
+}
+
+/*
+ * Check the battery against the fixture: a laptop off the mains with one
+ * pack discharging at 74% and the other full at 100%.  The full pack does
+ * not make it look charging, and as it reports charge rather than energy
+ * the two are averaged, not weighted.  The battery of a peripheral, here
+ * a mouse charging over USB at 5%, is left out.
+ */
+static bool check_battery(void)
+{
+	char buf[MAX_COMP_LEN] = "";
+
+	comp_battery(buf, sizeof(buf), NULL, NULL);
+	return strcmp(buf, "󰁹 87%") == 0 && component_on_battery();
+}
+
+/*
+ * Check that the vector usage kernels agree with the scalar one, and stay
+ * within 0-100%, on deltas across the whole 32-bit range, such as the
+ * first update after a long uptime gives.
+ */
+static bool check_cpu_kernels(void)
+{
+	static CpuTimes cur, prev[3];
+	static float usage[3][CPUSTAT_MAX_CORES];
+	uint32_t x = 12345;
+	unsigned fns = 1;
+	bool ok = true;
+
+	/* An odd number of cores leaves tails for the scalar code */
+	cur.n = 37;
+	for (unsigned i = 0; i < cur.n; i++) {
+		x = x * 1664525 + 1013904223;
+		cur.total[i] = i < 8 ? UINT32_MAX - i * 0x10000000 : x;
+		cur.idle[i] = i % 4 == 0 ? 0 : cur.total[i] / (i % 4 + 1);
+	}
+	cur.total[9] = cur.idle[9] = 0;
+
+	cpustat_usage_scalar(&cur, &prev[0], usage[0]);
+#if defined(__x86_64__)
+	cpustat_usage_sse2(&cur, &prev[fns++], usage[1]);
+	if (__builtin_cpu_supports("avx2"))
+		cpustat_usage_avx2(&cur, &prev[fns++], usage[2]);
+#endif
+	for (unsigned f = 0; f < fns; f++) {
+		for (unsigned i = 0; i < cur.n; i++)
+			ok = ok && usage[f][i] >= 0 && usage[f][i] <= 100;
+		ok = ok && memcmp(usage[f], usage[0],
+				  cur.n * sizeof(**usage)) == 0;
+	}
+	return ok;
+}
+
+/*
+ * Write /proc/stat text with a line for each of the ‘n’ CPUs ‘cpus’, with
+ * the total and idle times ‘times’ of each.
+ */
+static void hotplug_stat(char *buf, size_t size, const unsigned *cpus,
+			 const uint32_t (*times)[2], unsigned n)
+{
+	char *p = buf, *const end = buf + size - 1;
+	char line[128];
+
+	p = util_cat(p, end, "cpu  1 2 3 4 5 6 7 8 9 10\n");
+	for (unsigned i = 0; i < n; i++) {
+		(void)snprintf(line, sizeof(line),
+			       "cpu%u %" PRIu32 " 0 0 %" PRIu32 " 0 0 0 0 0 0\n",
+			       cpus[i], times[i][0] - times[i][1],
+			       times[i][1]);
+		p = util_cat(p, end, line);
+	}
+	*p = '\0';
+}
+
+/*
+ * Check that the usage of each core is measured against its own previous
+ * times when CPU 2 of 4 goes offline, and so out of /proc/stat, and comes
+ * back.
+ */
+static bool check_cpu_hotplug(void)
+{
+	static const unsigned all[] = { 0, 1, 2, 3 }, some[] = { 0, 1, 3 };
+	static const uint32_t t0[][2] = { { 1000, 500 },
+					  { 1000, 500 },
+					  { 900000, 100 },
+					  { 2000, 1000 } };
+	static const uint32_t t1[][2] = { { 1100, 550 },
+					  { 1100, 600 },
+					  { 2100, 1000 } };
+	static const uint32_t t2[][2] = { { 1200, 550 },
+					  { 1200, 700 },
+					  { 900100, 200 },
+					  { 2200, 1050 } };
+	static const float u1[] = { 50, 0, 100 }, u2[] = { 100, 0, 0, 50 };
+	static CpuTimes cur, prev;
+	static char stat[1024];
+	float usage[CPUSTAT_MAX_CORES];
+	bool ok;
+
+	hotplug_stat(stat, sizeof(stat), all, t0, LEN(all));
+	cpustat_parse(stat, &cur);
+	ok = !cpustat_usage(&cur, &prev, usage);
+
+	hotplug_stat(stat, sizeof(stat), some, t1, LEN(some));
+	cpustat_parse(stat, &cur);
+	ok = cpustat_usage(&cur, &prev, usage) && ok;
+	ok = ok && cur.n == LEN(u1) && cur.cpu[2] == 3 &&
+	     memcmp(usage, u1, sizeof(u1)) == 0;
+
+	/* CPU 2 is back, with no previous times: it shows as idle */
+	hotplug_stat(stat, sizeof(stat), all, t2, LEN(all));
+	cpustat_parse(stat, &cur);
+	ok = cpustat_usage(&cur, &prev, usage) && ok;
+	return ok && cur.n == LEN(u2) && memcmp(usage, u2, sizeof(u2)) == 0;
+}
+
+/*
+ * Check that a click event is routed by its ‘instance’ member alone, not
+ * by the same text in the values of other members.
+ */
+static bool check_click(void)
+{
+	static const char event[] =
+		",{\"name\":\"x \\\"instance\\\":\\\"1\\\"\","
+		"\"modifiers\":[\"instance\",{\"instance\":3}],"
+		"\"instance\":\"2\",\"button\":1}";
+	uint64_t before[NCOMPS];
+	bool ok = true;
+
+	for (size_t i = 0; i < NCOMPS; i++)
+		before[i] = atomic_load(&bench_sbar.components[i].stats.updates);
+	sbar_click(&bench_sbar, event);
+	for (size_t i = 0; i < NCOMPS; i++)
+		ok = ok && atomic_load(&bench_sbar.components[i].stats.updates) -
+				   before[i] == (i == 2);
+	return ok;
+}
+
+/*
+ * Check that commands do not read our standard input, which under -j are
+ * the click events meant for the bar.
+ */
+static bool check_child_stdin(void)
+{
+	char *argv[] = { "/bin/sh", "-c", "cat; echo eof", NULL };
+	char buf[64] = "";
+	int pipefd[2], in;
+	bool ok;
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0 ||
+	    (in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) < 0)
+		fatal(errno);
+	if (write(pipefd[1], "{\"instance\":\"0\"}\n", 17) != 17 ||
+	    dup2(pipefd[0], STDIN_FILENO) < 0)
+		fatal(errno);
+	ok = util_run_cmd(buf, sizeof(buf), argv, CHECK_TIMEOUT_MS);
+	if (dup2(in, STDIN_FILENO) < 0)
+		fatal(errno);
+	close(in);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return ok && strcmp(buf, "eof") == 0;
+}
+
+/*
+ * Check that a command whose output overflows the buffer and the pipe
+ * runs to completion, with its first line read.
+ */
+static bool check_long_output(void)
+{
+	char *argv[] = { "/bin/sh", "-c", "echo first; yes | head -c 1000000",
+			 NULL };
+	char buf[64] = "";
+
+	return util_run_cmd(buf, sizeof(buf), argv, CHECK_TIMEOUT_MS) &&
+	       strcmp(buf, "first") == 0;
+}
+
+#define REPLAY_COMP 6  // memory
+
+static FILE *capture;
+
+/* Send our standard output to a temporary file until capture_end() */
+static void capture_start(void)
+{
+	fflush(stdout);
+	capture = tmpfile();
+	if (!capture || dup2(fileno(capture), STDOUT_FILENO) < 0)
+		fatal(errno);
+}
+
+/*
+ * Restore our standard output from ‘out’, and read what was captured into
+ * ‘buf’, returning its length.
+ */
+static size_t capture_end(char *buf, size_t size, int out)
+{
+	size_t n;
+
+	fflush(stdout);
+	if (dup2(out, STDOUT_FILENO) < 0)
+		fatal(errno);
+	rewind(capture);
+	n = fread(buf, 1, size, capture);
+	(void)fclose(capture);
+	return n;
+}
+
+/*
+ * The session that check_replay() records: updates of a component and the
+ * changes of how it is shown made outside of them, its text expiring and
+ * it becoming stale, each followed by a flush.
+ */
+static void replay_session(Component *c)
+{
+	sbar_comp_update(c);
+	sbar_flush_output(&bench_sbar);
+	sbar_comp_expire(c);
+	sbar_flush_output(&bench_sbar);
+	comp_job_overdue(&c->job, true);
+	sbar_flush_output(&bench_sbar);
+	sbar_comp_update(c);
+	sbar_flush_output(&bench_sbar);
+	comp_job_overdue(&c->job, false);
+	sbar_flush_output(&bench_sbar);
+}
+
+/*
+ * Check that replaying a recorded session outputs the same frames as were
+ * output live.
+ */
+static bool check_replay(void)
+{
+	static char live[8192], replayed[8192];
+	char dir[] = "/tmp/mtstatus-bench-XXXXXX", path[64];
+	size_t nlive, nreplayed;
+	int out;
+
+	if (!mkdtemp(dir) || (out = dup(STDOUT_FILENO)) < 0)
+		fatal(errno);
+	(void)sbar_flush(&bench_sbar);
+
+	capture_start();
+	if (!trace_record_open(dir, NCOMPS))
+		fatal(errno);
+	replay_session(&bench_sbar.components[REPLAY_COMP]);
+	trace_close();
+	nlive = capture_end(live, sizeof(live), out);
+
+	capture_start();
+	if (!trace_replay_open(dir, NCOMPS))
+		fatal(errno);
+	sbar_replay(&bench_sbar, 0);
+	trace_close();
+	nreplayed = capture_end(replayed, sizeof(replayed), out);
+
+	close(out);
+	(void)snprintf(path, sizeof(path), "%s/trace", dir);
+	(void)unlink(path);
+	(void)rmdir(dir);
+	return nlive > 0 && nreplayed == nlive &&
+	       memcmp(replayed, live, nlive) == 0;
+}
+
+typedef struct {
+	const char *name;
+	bool (*check)(void);
+} Check;
+
+static const Check checks[] = {
+	{ "cpu kernels", check_cpu_kernels },
+	{ "cpu hotplug", check_cpu_hotplug },
+	{ "torn text", check_torn },
+	{ "blocked writers", check_writers_blocked },
+	{ "hung source", check_hung_source },
+	{ "battery", check_battery },
+	{ "click routing", check_click },
+	{ "child stdin", check_child_stdin },
+	{ "replay", check_replay },
+	{ "long output", check_long_output },
+};
+
+/*
+ * Run the checks and return whether they all passed.
+ */
+static bool bench_check(void)
+{
+	bool ok, all = true;
+
+	printf("\n%-28s %s\n", "check", "result");
+	for (size_t i = 0; i < LEN(checks); i++) {
+		fflush(stdout);
+		ok = checks[i].check();
+		printf("%-28s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+		all = all && ok;
+	}
+	return all;
+}
+
+static void bench_usage(FILE *f)
+{
+	(void)fputs("Usage: bench [-h] [-n iterations]\n", f);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned n = DEFAULT_ITERATIONS;
+	Result res[NCOMPS + 1];
+	struct rusage ru;
+	int64_t *lat;
+	bool traced, ok;
+	int option, out, err, null;
+
+	while ((option = getopt(argc, argv, "hn:")) != -1) {
+		switch (option) {
+		case 'h':
+			bench_usage(stdout);
+			exit(EXIT_SUCCESS);
+		case 'n':
+			n = (unsigned)strtoul(optarg, NULL, 10);
+			if (n > 0)
+				break;
+			/* Fall through */
+		default:
+			bench_usage(stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	lat = calloc(n, sizeof(*lat));
+	if (!lat)
+		fatal(errno);
+	bench_sbar_create();
+
+	/* The status and errors of components without hardware (e.g. wifi)
+	   would drown the report */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	err = dup(STDERR_FILENO);
+	null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (out < 0 || err < 0 || null < 0)
+		fatal(errno);
+	(void)dup2(null, STDOUT_FILENO);
+	(void)dup2(null, STDERR_FILENO);
+
+	for (unsigned p = 0; p <= PIPELINE; p++)
+		bench_time(p, n, lat, &res[p]);
+	traced = bench_count_syscalls(TRACED_ITERATIONS, res);
+
+	fflush(stdout);
+	(void)dup2(out, STDOUT_FILENO);
+	(void)dup2(err, STDERR_FILENO);
+
+	printf("root %s, %u updates per component\n\n", ROOT_PREFIX, n);
+	printf("%-12s %10s %10s %10s %9s %7s\n", "component", "p50 ns",
+	       "p99 ns", "max ns", "syscalls", "allocs");
+	for (unsigned p = 0; p <= PIPELINE; p++) {
+		printf("%-12s %10" PRId64 " %10" PRId64 " %10" PRId64,
+		       p < NCOMPS ? bench_comps[p].name : "pipeline",
+		       res[p].p50, res[p].p99, res[p].max);
+		if (traced)
+			printf(" %9.1f", res[p].syscalls);
+		else
+			printf(" %9s", "n/a");
+		printf(" %7.2f\n", res[p].allocs);
+	}
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		fatal(errno);
+	bench_parsers(n);
+	bench_cpu_cores(n);
+	bench_contention();
+	bench_spawn();
+	printf("\npeak RSS %ld KiB\n", ru.ru_maxrss);
+	free(lat);
+	ok = bench_check();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,11 @@
+#include "component.h"
+
+#include "cpustat.h"
+#include "display.h"
+#include "history.h"
 #include "mtstatus.h"
+#include "netlink.h"
+#include "parse.h"
 #include "util.h"
 
 #include <assert.h>
@@ -7,29 +14,50 @@
 #include <linux/if.h>
 #include <linux/limits.h>
 #include <linux/wireless.h>
-#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/statvfs.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 // Max link quality value in /proc/net/wireless
 #define MAX_WIFI_QUALITY 70
 
-#define BATTERY_CAPACITY_FILE "/sys/class/power_supply/BAT0/capacity"
-#define BATTERY_STATUS_FILE   "/sys/class/power_supply/BAT0/status"
+/* Prepended to the procfs and sysfs paths read, so that the components can
+   be run against fixture files (see ‘make bench’) */
+#ifndef ROOT_PREFIX
+#define ROOT_PREFIX ""
+#endif
+
+#define POWER_SUPPLY_DIR ROOT_PREFIX "/sys/class/power_supply"
 
 #define BUF_SIZE 128
 
+/* Quiet period after a change to the notmuch database before recounting */
+#define NOTMUCH_SETTLE_MS 500
+
+/* Time allowed for external commands before they are killed */
+#define NOTMUCH_TIMEOUT_MS 5000
+#define VOLUME_TIMEOUT_MS  1000
+
 typedef bool (*Parser)(char *, const size_t, char *, const size_t,
 		       const char *);
 
-static pthread_mutex_t cpu_data_mtx = PTHREAD_MUTEX_INITIALIZER,
-		       net_traffic_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* Whether the last battery update found us running on battery */
+static atomic_bool on_battery;
+
+static int notmuch_epfd = -1, notmuch_inotify_fd = -1, notmuch_timer_fd = -1;
+
+/* Weight of the newest sample in the smoothed value shown with a sparkline */
+#define SPARK_EWMA_ALPHA 0.3f
 
 static void render_component(char *buf, const size_t bufsize, const char *fmt,
 			     ...)
@@ -42,36 +70,6 @@ static void render_component(char *buf, const size_t bufsize, const char *fmt,
 	assert(n >= 0 && (size_t)n < bufsize);
 }
 
-static bool parse_net_stats(char *buf, const size_t bufsize, uint64_t *val,
-			    const char *path_templ, const char *iface)
-{
-	char path[PATH_MAX];
-	int n = snprintf(path, sizeof(path), path_templ, iface);
-	if (n < 0) {
-		log_err("Error creating net statistics filepath for '%s'",
-			iface);
-		return false;
-	}
-	if ((size_t)n >= sizeof(path)) {
-		log_err("Error: net statistics filepath for '%s' too big",
-			iface);
-		return false;
-	}
-
-	FILE *f = fopen(path, "r");
-	if (!f) {
-		log_errno(errno, "Error: unable to open '%s'", path);
-		return false;
-	}
-	n = fscanf(f, "%lu", val);
-	(void)fclose(f);
-	if (n != 1) {
-		log_err("Error: unable to parse '%s'", path);
-		return false;
-	}
-	return true;
-}
-
 static bool get_wifi_essid(char *buffer, const char *interface)
 {
 	bool return_val = false;
@@ -86,12 +84,12 @@ static bool get_wifi_essid(char *buffer, const char *interface)
 
 	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sockfd == -1) {
-		log_errno(errno, "Error creating socket: %s");
+		log_errno(errno, "Error creating socket");
 		goto out;
 	}
 	iwreq.u.essid.pointer = buffer;
 	if (ioctl(sockfd, SIOCGIWESSID, &iwreq) == -1) {
-		log_errno(errno, "Error reading socket: %s");
+		log_errno(errno, "Error reading ESSID of '%s'", interface);
 		goto cleanup;
 	}
 	return_val = true;
@@ -102,35 +100,34 @@ out:
 	return return_val;
 }
 
-void comp_keyboard_indicator(char *buf, const size_t bufsize, const char *args)
+/*
+ * Show the active keyboard layout and the Caps and Num Lock indicators, as
+ * last reported by XKB.
+ */
+void comp_keyboard_indicator(char *buf, const size_t bufsize, const char *args,
+			     void *state)
 {
-	if (dpy) {
-		XKeyboardState state;
-		XGetKeyboardControl(dpy, &state);
-
-		bool caps_on = state.led_mask & (1 << 0);
-		bool numlock_on = state.led_mask & (1 << 1);
-		const char *val = "";
-		if (caps_on && numlock_on) {
-			val = "Caps Num";
-		} else if (caps_on) {
-			val = "Caps";
-		} else if (numlock_on) {
-			val = "Num";
-		}
+	KeyboardState kb;
 
-		size_t len = strlen(val);
-		assert(bufsize >= len + 1);
-		memcpy(buf, val, len + 1);
-	}
+	*buf = '\0';
+	if (display_keyboard_get(&kb))
+		render_component(buf, bufsize, "%s%s%s", kb.layout,
+				 kb.caps ? " Caps" : "", kb.num ? " Num" : "");
 }
 
-void comp_notmuch(char *buf, const size_t bufsize, const char *args)
+/*
+ * Show the number of unread messages.  The count is updated whenever the
+ * notmuch database changes (see notmuch_watch()), so the component needs no
+ * interval; ‘args’ optionally names the database directory to watch.
+ */
+void comp_notmuch(char *buf, const size_t bufsize, const char *args,
+		  void *state)
 {
 	char *const argv[] = { "notmuch", "count",
 			       "tag:unread NOT tag:archived", NULL };
 	char cmdbuf[BUF_SIZE] = { 0 };
-	bool s = util_run_cmd(cmdbuf, sizeof(cmdbuf), argv);
+	bool s = util_run_cmd(cmdbuf, sizeof(cmdbuf), argv,
+			      NOTMUCH_TIMEOUT_MS);
 	if (!s) {
 		log_err("Unable to run 'notmuch'");
 		render_component(buf, bufsize, " %s", err_str);
@@ -143,154 +140,335 @@ void comp_notmuch(char *buf, const size_t bufsize, const char *args)
 			 count);
 }
 
-void comp_cpu(char *buf, const size_t bufsize, const char *args)
+/*
+ * Parse ‘args’ of the form "spark [level]" into the level of history to
+ * draw as a sparkline, and return whether a sparkline was asked for.
+ */
+static bool spark_args(const char *args, unsigned *level)
 {
-	const char *file = "/proc/stat";
-	FILE *fp = fopen(file, "r");
-	if (!fp) {
+	if (!args || strncmp(args, "spark", strlen("spark")) != 0)
+		return false;
+	*level = (unsigned)strtoul(args + strlen("spark"), NULL, 10);
+	if (*level >= HISTORY_LEVELS)
+		*level = HISTORY_LEVELS - 1;
+	return true;
+}
+
+typedef struct {
+	bool primed;  // the times are from a previous update
+	uint64_t total, idle;
+	bool spark;
+	History history;
+} CpuState;
+
+static void *cpu_init(const char *args)
+{
+	CpuState *st = calloc(1, sizeof(*st));
+	unsigned level;
+
+	if (st && (st->spark = spark_args(args, &level)))
+		history_init(&st->history, HISTORY_MEAN, SPARK_EWMA_ALPHA,
+			     level);
+	return st;
+}
+
+/*
+ * Show the usage of all cores since the last update.  With ‘args’ "spark
+ * [level]", precede it with a sparkline of its history at that level (see
+ * history.h) and show the EWMA of the usage rather than the last sample.
+ */
+void comp_cpu(char *buf, const size_t bufsize, const char *args, void *state)
+{
+	const char *file = ROOT_PREFIX "/proc/stat";
+	char stat[BUF_SIZE * 2];
+	if (util_source_read(file, stat, sizeof(stat)) < 0) {
 		log_errno(errno, "Error: unable to open '%s'", file);
 		goto err_ret;
 	}
 
 	uint64_t t[7];
-	int n = fscanf(fp, "cpu  %lu %lu %lu %lu %lu %lu %lu", &t[0], &t[1],
-		       &t[2], &t[3], &t[4], &t[5], &t[6]);
-	(void)fclose(fp);
-	if (n != LEN(t)) {
+	const char *line = parse_line(stat, "cpu ");
+	if (!line || parse_u64s(line, t, LEN(t)) != LEN(t)) {
 		log_err("Error parsing '%s'", file);
 		goto err_ret;
 	}
 
-	static uint64_t total_prev, idle_prev;
-
+	CpuState *const st = state;
 	uint64_t total_cur = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6];
 	uint64_t idle_cur = t[3];
 
-	pthread_mutex_lock(&cpu_data_mtx);
-	uint64_t total = total_cur - total_prev;
-	uint64_t idle = idle_cur - idle_prev;
-	total_prev = total_cur;
-	idle_prev = idle_cur;
-	pthread_mutex_unlock(&cpu_data_mtx);
+	/* The first delta is the usage since boot, which has no place in the
+	   history */
+	const bool first = !st->primed;
+	uint64_t total = total_cur - st->total;
+	uint64_t idle = idle_cur - st->idle;
+	st->total = total_cur;
+	st->idle = idle_cur;
+	st->primed = true;
+
+	/* No ticks since the last update: keep showing the last usage */
+	if (total == 0)
+		return;
 
 	uint64_t usage = 100 * (total - idle) / total;
-	render_component(buf, bufsize, " %ld%%", usage);
+	if (!st->spark) {
+		render_component(buf, bufsize, " %ld%%", usage);
+		return;
+	}
+
+	if (!first)
+		history_push(&st->history, (float)usage);
+	render_component(buf, bufsize, " %s %.0f%%",
+			 history_spark(&st->history),
+			 first ? (double)usage
+			       : (double)history_ewma(&st->history));
 	return;
 
 err_ret:
 	render_component(buf, bufsize, " %s", err_str);
 }
 
-void comp_memory_available(char *buffer, const size_t buffer_size,
-			   const char *args)
+/*
+ * Render a bar graph of ‘n’ usages in percent after ‘p’.  When there are
+ * more cores than bars fit, each bar shows the busiest of a group of
+ * adjacent cores, so that a single pegged core is never averaged away.
+ */
+static void render_core_bars(char *p, const char *end, const float *usage,
+			     const unsigned n)
 {
-	const char *file = "/proc/meminfo", *label = "MemAvailable";
-	char *line_buffer = NULL;
-	size_t line_buffer_len = 0;
-	char unformatted[64], formatted[64];
-	unsigned long value;
-
-	if (!util_file_get_line(&line_buffer, &line_buffer_len, label, file)) {
-		log_err("Couldn't find line containing '%s' in file %s", label,
-			file);
-		render_component(buffer, buffer_size, " %s", err_str);
+	static const char *const bars[] = { "▁", "▂", "▃", "▄",
+					    "▅", "▆", "▇", "█" };
+	const unsigned slots = (unsigned)(end - p) / (sizeof("█") - 1);
+	const unsigned group = slots ? (n + slots - 1) / slots : n;
+	unsigned level;
+	float max;
+
+	for (unsigned i = 0; i < n && group; i += group) {
+		max = 0;
+		for (unsigned j = i; j < i + group && j < n; j++)
+			max = usage[j] > max ? usage[j] : max;
+		level = (unsigned)(max * LEN(bars) / 100);
+		if (level >= LEN(bars))
+			level = LEN(bars) - 1;
+		p = util_cat(p, end, bars[level]);
+	}
+	*p = '\0';
+}
+
+typedef struct {
+	CpuTimes prev, cur;
+	/* Kept here rather than on the stack of the thread updating us */
+	char stat[CPUSTAT_MAX_CORES * 128];
+} CpuCoresState;
+
+/*
+ * Show the usage of each core since the last update: with ‘args’ NULL or
+ * "bars" as a bar graph, and with "max" as the usage of the busiest core
+ * and the mean over all cores.
+ */
+void comp_cpu_cores(char *buf, const size_t bufsize, const char *args,
+		    void *state)
+{
+	const char *file = ROOT_PREFIX "/proc/stat";
+	CpuCoresState *const st = state;
+	float usage[CPUSTAT_MAX_CORES], sum = 0;
+	unsigned busiest = 0;
+
+	if (util_source_read(file, st->stat, sizeof(st->stat)) < 0) {
+		log_errno(errno, "Error: unable to open '%s'", file);
+		goto err_ret;
+	}
+	if (!cpustat_parse(st->stat, &st->cur)) {
+		log_err("Error parsing '%s'", file);
+		goto err_ret;
+	}
+
+	/* Without previous times there is no usage to show yet */
+	if (!cpustat_usage(&st->cur, &st->prev, usage))
+		return;
+
+	if (!args || strcmp(args, "bars") == 0) {
+		render_component(buf, bufsize, " ");
+		render_core_bars(buf + strlen(buf), buf + bufsize - 1, usage,
+				 st->cur.n);
 		return;
 	}
+	for (unsigned i = 0; i < st->cur.n; i++) {
+		sum += usage[i];
+		if (usage[i] > usage[busiest])
+			busiest = i;
+	}
+	render_component(buf, bufsize,
+			 " max %.0f%% (cpu%u) mean %.0f%%",
+			 (double)usage[busiest], st->cur.cpu[busiest],
+			 (double)(sum / (float)st->cur.n));
+	return;
+
+err_ret:
+	render_component(buf, bufsize, " %s", err_str);
+}
+
+void comp_memory_available(char *buffer, const size_t buffer_size,
+			   const char *args, void *state)
+{
+	const char *file = ROOT_PREFIX "/proc/meminfo";
+	const char *label = "MemAvailable:";
+	char contents[4096], formatted[64];
+	const char *line;
+	uint64_t value;
 
-	if (!util_string_get_nth_field(unformatted, LEN(unformatted),
-				       line_buffer, 2)) {
-		log_err("Couldn't find field 2 in line '%s'", line_buffer);
-		free(line_buffer);
-		render_component(buffer, buffer_size, " %s", err_str);
+	if (util_source_read(file, contents, sizeof(contents)) < 0) {
+		log_errno(errno, "Error: unable to open '%s'", file);
+		render_component(buffer, buffer_size, " %s", err_str);
 		return;
 	}
 
-	free(line_buffer);
+	line = parse_line(contents, label);
+	if (!line || !parse_u64(line, &value)) {
+		log_err("Couldn't find '%s' in file %s", label, file);
+		render_component(buffer, buffer_size, " %s", err_str);
+		return;
+	}
 
-	value = strtoul(unformatted, NULL, 0);
 	util_fmt_human(formatted, LEN(formatted), value * K_IEC, K_IEC);
-	render_component(buffer, buffer_size, " %s%s", formatted, "B");
+	render_component(buffer, buffer_size, " %s%s", formatted, "B");
 }
 
-void comp_net_traffic(char *buf, const size_t bufsize, const char *iface)
+typedef struct {
+	char iface[IFNAMSIZ];
+	bool primed;  // the counters are from a previous update
+	uint64_t rx, tx;
+	int64_t t_ns;  // when they were read
+	bool spark;
+	History history;
+} NetTrafficState;
+
+/*
+ * Split ‘args’ of the form "iface [spark [level]]".
+ */
+static void *net_traffic_init(const char *args)
 {
-	uint64_t rx_cur, tx_cur;
+	const size_t name_len = strcspn(args, " ");
+	NetTrafficState *st;
+	unsigned level;
+
+	if (name_len >= IFNAMSIZ) {
+		log_err("Interface name '%s' is too long", args);
+		errno = EINVAL;
+		return NULL;
+	}
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	memcpy(st->iface, args, name_len);
+	st->iface[name_len] = '\0';
+	args += name_len + strspn(args + name_len, " ");
+	if ((st->spark = spark_args(args, &level)))
+		history_init(&st->history, HISTORY_MAX, SPARK_EWMA_ALPHA,
+			     level);
+	return st;
+}
 
-	bool s = parse_net_stats(buf, bufsize, &rx_cur,
-				 "/sys/class/net/%s/statistics/rx_bytes",
-				 iface);
-	if (!s) {
-		log_err("Unable to parse network rx bytes");
+/*
+ * Show the rates at which the interface named by ‘args’ received and sent
+ * bytes since the last update, measured against the monotonic clock so
+ * that they hold however long the update was apart from the last.  With
+ * "iface spark [level]", precede them with a sparkline of the history of
+ * their sum at that level, each bucket of which is the busiest of the
+ * updates it covers.
+ */
+void comp_net_traffic(char *buf, const size_t bufsize, const char *args,
+		      void *state)
+{
+	NetTrafficState *const st = state;
+	char rx_buf[BUF_SIZE], tx_buf[BUF_SIZE];
+	uint64_t rx, tx;
+	int64_t now;
+	NlLink link;
+
+	if (!nl_link_get(st->iface, &link)) {
+		log_errno(errno, "Unable to get network statistics for '%s'",
+			  st->iface);
 		goto err_ret;
 	}
-	s = parse_net_stats(buf, bufsize, &tx_cur,
-			    "/sys/class/net/%s/statistics/tx_bytes", iface);
-	if (!s) {
-		log_err("Unable to parse network tx bytes");
-		goto err_ret;
+	now = util_monotonic_ns();
+
+	/* Counters that went backwards belong to a new interface */
+	const bool first = !st->primed || now <= st->t_ns ||
+			   link.rx_bytes < st->rx || link.tx_bytes < st->tx;
+	const double secs = (double)(now - st->t_ns) / 1e9;
+	rx = first ? 0 : (uint64_t)((double)(link.rx_bytes - st->rx) / secs);
+	tx = first ? 0 : (uint64_t)((double)(link.tx_bytes - st->tx) / secs);
+	st->rx = link.rx_bytes;
+	st->tx = link.tx_bytes;
+	st->t_ns = now;
+	st->primed = true;
+
+	if (!(link.flags & IFF_RUNNING)) {
+		render_component(buf, bufsize, "%s down", st->iface);
+		return;
 	}
+	/* A rate needs two readings: keep the text until then */
+	if (first)
+		return;
 
-	static uint64_t rx_prev, tx_prev;
-
-	pthread_mutex_lock(&net_traffic_mtx);
-	uint64_t rx = rx_cur - rx_prev;
-	uint64_t tx = tx_cur - tx_prev;
-	rx_prev = rx_cur;
-	tx_prev = tx_cur;
-	pthread_mutex_unlock(&net_traffic_mtx);
-
-	char rx_buf[BUF_SIZE], tx_buf[BUF_SIZE];
+	if (st->spark)
+		history_push(&st->history, (float)(rx + tx));
 	util_fmt_human(rx_buf, sizeof(rx_buf), rx, K_IEC);
 	util_fmt_human(tx_buf, sizeof(tx_buf), tx, K_IEC);
-	render_component(buf, bufsize, "%7s%s▾ %7s%s▴", rx_buf, "B", tx_buf,
-			 "B");
+	render_component(buf, bufsize, "%s%s%7s%s▾ %7s%s▴",
+			 st->spark ? history_spark(&st->history) : "",
+			 st->spark ? " " : "", rx_buf, "B", tx_buf, "B");
 	return;
 
 err_ret:
 	render_component(buf, bufsize, "%s▾ %s▴", err_str, err_str);
 }
 
-void comp_wifi(char *buffer, const size_t buffer_size, const char *device)
+void comp_wifi(char *buffer, const size_t buffer_size, const char *device,
+	       void *state)
 {
-	const char *file = "/proc/net/wireless";
-	char *line_buffer = NULL;
-	size_t line_buffer_len = 0;
-	char unformatted[64], formatted[64];
-	char essid[IW_ESSID_MAX_SIZE + 1];
-	unsigned long value;
-
-	if (!util_file_get_line(&line_buffer, &line_buffer_len, device, file)) {
-		log_err("Couldn't find line containing '%s' in file %s", device,
-			file);
-		render_component(buffer, buffer_size, " %s", err_str);
+	const char *file = ROOT_PREFIX "/proc/net/wireless";
+	char contents[1024], key[IFNAMSIZ + 1];
+	char essid[IW_ESSID_MAX_SIZE + 1] = "";
+	const char *line;
+	uint64_t value;
+
+	if (util_source_read(file, contents, sizeof(contents)) < 0) {
+		log_errno(errno, "Error: unable to open '%s'", file);
+		render_component(buffer, buffer_size, " %s", err_str);
 		return;
 	}
 
-	if (!util_string_get_nth_field(unformatted, LEN(unformatted),
-				       line_buffer, 3)) {
-		log_err("Couldn't find field 3 in line '%s'", line_buffer);
-		free(line_buffer);
-		render_component(buffer, buffer_size, " %s", err_str);
+	/* Lines are of the form "wlan0: status link level noise ..." */
+	(void)snprintf(key, sizeof(key), "%s:", device);
+	line = parse_line(contents, key);
+	if (!line) {
+		log_err("Couldn't find line for '%s' in file %s", device, file);
+		render_component(buffer, buffer_size, " %s", err_str);
+		return;
+	}
+	line = parse_field(line, 2);
+	if (!line || !parse_u64(line, &value)) {
+		log_err("Couldn't parse link quality for '%s' in file %s",
+			device, file);
+		render_component(buffer, buffer_size, " %s", err_str);
 		return;
 	}
-
-	free(line_buffer);
-
-	value = strtoul(unformatted, NULL, 0);
-	(void)snprintf(formatted, LEN(formatted), "%ld",
-		       value * 100 / MAX_WIFI_QUALITY);
 
 	get_wifi_essid(essid, device);
 
-	render_component(buffer, buffer_size, " %s%% %s", formatted, essid);
+	render_component(buffer, buffer_size, " %lu%% %s",
+			 value * 100 / MAX_WIFI_QUALITY, essid);
 }
 
-void comp_disk_free(char *buf, const size_t bufsize, const char *path)
+void comp_disk_free(char *buf, const size_t bufsize, const char *path,
+		    void *state)
 {
 	struct statvfs fs;
-	int r = statvfs(path, &fs);
+	int r = util_statvfs(path, &fs);
 	if (r == -1) {
-		log_errno(errno, "Error: statvfs: %s");
+		log_errno(errno, "Error: statvfs '%s'", path);
 		log_err("Unable to determine disk free space");
 		render_component(buf, bufsize, "󰋊 %s", err_str);
 		return;
@@ -301,12 +479,12 @@ void comp_disk_free(char *buf, const size_t bufsize, const char *path)
 	render_component(buf, bufsize, "󰋊 %sB", output);
 }
 
-void comp_volume(char *buf, const size_t bufsize, const char *path)
+void comp_volume(char *buf, const size_t bufsize, const char *path, void *state)
 {
 	char *const argv[] = { "pamixer", "--get-volume-human", NULL };
 
 	char cmdbuf[BUF_SIZE] = { 0 };
-	bool s = util_run_cmd(cmdbuf, sizeof(cmdbuf), argv);
+	bool s = util_run_cmd(cmdbuf, sizeof(cmdbuf), argv, VOLUME_TIMEOUT_MS);
 	if (!s) {
 		log_err("Unable to determine volume");
 		render_component(buf, bufsize, "󰝟 %s", err_str);
@@ -315,50 +493,271 @@ void comp_volume(char *buf, const size_t bufsize, const char *path)
 	render_component(buf, bufsize, "󰕾 %s", cmdbuf);
 }
 
-void comp_battery(char *buf, const size_t bufsize, const char *args)
+/*
+ * Return whether the uevent file ‘contents’ sets ‘key’ to ‘val’.
+ */
+static bool uevent_is(const char *contents, const char *key, const char *val)
 {
-	FILE *capacity_file, *status_file;
-	int capacity;
-	char status[16];
-	char *icon = "󰁹";
+	const char *p = parse_line(contents, key);
+	size_t len = strlen(val);
+
+	return p && strncmp(p, val, len) == 0 &&
+	       (p[len] == '\n' || p[len] == '\0');
+}
 
-	capacity_file = fopen(BATTERY_CAPACITY_FILE, "r");
-	if (!capacity_file) {
+static uint64_t uevent_u64(const char *contents, const char *key)
+{
+	const char *p = parse_line(contents, key);
+	uint64_t val = 0;
+
+	if (p)
+		(void)parse_u64(p, &val);
+	return val;
+}
+
+/*
+ * Stream formatter for "pactl subscribe": update the volume whenever the
+ * server reports a change to a sink, and otherwise leave it as it is.
+ */
+void comp_volume_event(char *buf, const size_t bufsize, const char *event,
+		       void *state)
+{
+	if (!*event || strstr(event, " on sink #") ||
+	    strstr(event, " on server"))
+		comp_volume(buf, bufsize, NULL, NULL);
+}
+
+/*
+ * Stream formatter that shows each line verbatim.
+ */
+void comp_stream_line(char *buf, const size_t bufsize, const char *line,
+		      void *state)
+{
+	if (*line)
+		render_component(buf, bufsize, "%.*s", (int)bufsize - 1, line);
+}
+
+void comp_battery(char *buf, const size_t bufsize, const char *args,
+		  void *state)
+{
+	char path[PATH_MAX], contents[2048], names[1024];
+	uint64_t now = 0, full = 0, capacity = 0;
+	unsigned nbatteries = 0, nenergy = 0;
+	bool external = false, online = false, discharging = false, charging;
+	const char *name, *end;
+	int n;
+
+	/*
+	 * Sum over every battery, and show the charging icon if we run on
+	 * external power: if any external supply, e.g. the mains adapter, is
+	 * online, or without one if no battery is discharging.  A battery
+	 * that is full says nothing about where the power comes from when
+	 * another one is in use.  Supplies of a device, e.g. the battery of
+	 * a wireless mouse, do not power the system and are left out, as are
+	 * empty battery bays.
+	 */
+	if (util_dir_list(POWER_SUPPLY_DIR, names, sizeof(names)) < 0) {
 		log_errno(errno, "Error: unable to open '%s'",
-			  BATTERY_CAPACITY_FILE);
+			  POWER_SUPPLY_DIR);
 		goto err_ret;
 	}
-	fscanf(capacity_file, "%d", &capacity);
-	fclose(capacity_file);
+	for (name = names; *name; name = *end ? end + 1 : end) {
+		end = strchrnul(name, '\n');
+		n = snprintf(path, sizeof(path), "%s/%.*s/uevent",
+			     POWER_SUPPLY_DIR, (int)(end - name), name);
+		if (n < 0 || (size_t)n >= sizeof(path))
+			continue;
+		if (util_source_read(path, contents, sizeof(contents)) < 0)
+			continue;
+
+		if (uevent_is(contents, "POWER_SUPPLY_SCOPE=", "Device") ||
+		    uevent_is(contents, "POWER_SUPPLY_PRESENT=", "0"))
+			continue;
+		if (!uevent_is(contents, "POWER_SUPPLY_TYPE=", "Battery")) {
+			external = true;
+			if (uevent_is(contents, "POWER_SUPPLY_ONLINE=", "1"))
+				online = true;
+			continue;
+		}
+		nbatteries++;
+		if (uevent_is(contents, "POWER_SUPPLY_STATUS=", "Discharging"))
+			discharging = true;
+		capacity += uevent_u64(contents, "POWER_SUPPLY_CAPACITY=");
+		if (parse_line(contents, "POWER_SUPPLY_ENERGY_FULL=") &&
+		    parse_line(contents, "POWER_SUPPLY_ENERGY_NOW=")) {
+			nenergy++;
+			now += uevent_u64(contents, "POWER_SUPPLY_ENERGY_NOW=");
+			full += uevent_u64(contents,
+					   "POWER_SUPPLY_ENERGY_FULL=");
+		}
+	}
 
-	status_file = fopen(BATTERY_STATUS_FILE, "r");
-	if (!status_file) {
-		log_errno(errno, "Error: unable to open '%s'",
-			  BATTERY_STATUS_FILE);
+	if (!nbatteries) {
+		log_err("Error: no battery found in '%s'", POWER_SUPPLY_DIR);
 		goto err_ret;
 	}
-	fscanf(status_file, "%s", status);
-	fclose(status_file);
-
-	if (strcmp(status, "Full") == 0 || strcmp(status, "Charging") == 0)
-		icon = "󰂄";
-
-	render_component(buf, bufsize, "%s %d%%", icon, capacity);
+	/* With several batteries, weight each by its size when they all report
+	   their energy, so that a small battery does not count as much as a
+	   large one.  Charge is left out: it is not comparable across packs of
+	   different voltages. */
+	if (nbatteries > 1 && nenergy == nbatteries && full)
+		capacity = 100 * now / full;
+	else
+		capacity /= nbatteries;
+	charging = external ? online : !discharging;
+
+	atomic_store_explicit(&on_battery, !charging, memory_order_relaxed);
+	render_component(buf, bufsize, "%s %lu%%", charging ? "󰂄" : "󰁹",
+			 capacity);
 	return;
 
 err_ret:
-	render_component(buf, bufsize, "%s %s", icon, err_str);
+	atomic_store_explicit(&on_battery, false, memory_order_relaxed);
+	render_component(buf, bufsize, "%s %s", "󰁹", err_str);
 }
 
-void comp_datetime(char *buf, const size_t bufsize, const char *date_fmt)
+/*
+ * Return whether the machine was running on battery when comp_battery()
+ * last looked.  Without a battery component this is always false.
+ */
+bool component_on_battery(void)
+{
+	return atomic_load_explicit(&on_battery, memory_order_relaxed);
+}
+
+void comp_datetime(char *buf, const size_t bufsize, const char *date_fmt,
+		   void *state)
 {
-	time_t t = time(NULL);
-	assert(t != -1);
 	struct tm now;
-	struct tm *ret_l = localtime_r(&t, &now);
-	assert(ret_l);
+	bool ok = util_local_time(&now);
+	assert(ok);
 	char output[bufsize];
 	size_t ret_s = strftime(output, sizeof(output), date_fmt, &now);
 	assert(ret_s);
 	render_component(buf, bufsize, " %s", output);
 }
+
+/*
+ * Watch the notmuch database directory ‘dbdir’, or if it is NULL, the
+ * Xapian directory under notmuch's database.path.  The returned descriptor
+ * is an epoll set holding the inotify descriptor and a timer used to let a
+ * burst of changes settle before recounting.
+ */
+static int notmuch_watch(const char *dbdir)
+{
+	const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+			      IN_DELETE | IN_MODIFY;
+	char *const argv[] = { "notmuch", "config", "get", "database.path",
+			       NULL };
+	char cmdbuf[BUF_SIZE], path[PATH_MAX];
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if (notmuch_epfd >= 0)
+		return notmuch_epfd;
+
+	if (!dbdir) {
+		if (!util_run_cmd(cmdbuf, sizeof(cmdbuf), argv,
+				  NOTMUCH_TIMEOUT_MS))
+			return -1;
+		int n = snprintf(path, sizeof(path), "%s/.notmuch/xapian",
+				 cmdbuf);
+		if (n < 0 || (size_t)n >= sizeof(path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		dbdir = path;
+	}
+
+	notmuch_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	notmuch_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	notmuch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (notmuch_inotify_fd < 0 || notmuch_timer_fd < 0 ||
+	    notmuch_epfd < 0 ||
+	    inotify_add_watch(notmuch_inotify_fd, dbdir, mask) < 0)
+		goto err;
+	ev.data.fd = notmuch_inotify_fd;
+	if (epoll_ctl(notmuch_epfd, EPOLL_CTL_ADD, notmuch_inotify_fd, &ev) <
+	    0)
+		goto err;
+	ev.data.fd = notmuch_timer_fd;
+	if (epoll_ctl(notmuch_epfd, EPOLL_CTL_ADD, notmuch_timer_fd, &ev) < 0)
+		goto err;
+	return notmuch_epfd;
+
+err:
+	log_errno(errno, "Error: unable to watch '%s'", dbdir);
+	close(notmuch_inotify_fd);
+	close(notmuch_timer_fd);
+	close(notmuch_epfd);
+	notmuch_inotify_fd = notmuch_timer_fd = notmuch_epfd = -1;
+	return -1;
+}
+
+/*
+ * Each change to the database (re)starts the settle timer, and the count
+ * is updated only once the timer expires.
+ */
+static bool notmuch_drain(const int epfd)
+{
+	const struct itimerspec settle = {
+		.it_value = { .tv_sec = NOTMUCH_SETTLE_MS / 1000,
+			      .tv_nsec = NOTMUCH_SETTLE_MS % 1000 * 1000000L },
+	};
+	char buf[4096];
+	bool changed = false, settled = false;
+	uint64_t expirations;
+
+	while (read(notmuch_inotify_fd, buf, sizeof(buf)) > 0)
+		changed = true;
+	if (read(notmuch_timer_fd, &expirations, sizeof(expirations)) > 0)
+		settled = true;
+
+	if (changed) {
+		(void)timerfd_settime(notmuch_timer_fd, 0, &settle, NULL);
+		return false;
+	}
+	return settled;
+}
+
+static void *cpu_cores_init(const char *args)
+{
+	return calloc(1, sizeof(CpuCoresState));
+}
+
+static int net_traffic_watch(const char *iface)
+{
+	return nl_link_monitor();
+}
+
+static int battery_watch(const char *args)
+{
+	return nl_uevent_monitor();
+}
+
+static bool battery_drain(const int fd)
+{
+	return nl_uevent_drain(fd, "power_supply");
+}
+
+static int keyboard_watch(const char *args)
+{
+	return display_keyboard_monitor();
+}
+
+const ComponentWatch component_watches[] = {
+	{ comp_keyboard_indicator, keyboard_watch, display_keyboard_drain },
+	{ comp_net_traffic, net_traffic_watch, nl_link_drain },
+	{ comp_battery, battery_watch, battery_drain },
+	{ comp_notmuch, notmuch_watch, notmuch_drain },
+};
+
+const size_t component_nwatches = LEN(component_watches);
+
+const ComponentInstance component_instances[] = {
+	{ comp_cpu, cpu_init, free },
+	{ comp_cpu_cores, cpu_cores_init, free },
+	{ comp_net_traffic, net_traffic_init, free },
+};
+
+const size_t component_ninstances = LEN(component_instances);
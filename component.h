@@ -1,17 +1,62 @@
 #ifndef COMPONENT_H
 #define COMPONENT_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
-void comp_keyboard_indicator(char *buf, size_t bufsize, const char *args);
-void comp_notmuch(char *buf, size_t bufsize, const char *args);
-void comp_net_traffic(char *buf, size_t bufsize, const char *iface);
-void comp_cpu(char *buf, size_t bufsize, const char *args);
-void comp_memory_available(char *buf, size_t bufsize, const char *args);
-void comp_disk_free(char *buf, size_t bufsize, const char *path);
-void comp_volume(char *buf, size_t bufsize, const char *path);
-void comp_wifi(char *buf, size_t bufsize, const char *device);
-void comp_battery(char *buf, size_t bufsize, const char *args);
-void comp_datetime(char *buf, size_t bufsize, const char *date_fmt);
+/*
+ * A component that can also be updated as soon as the kernel reports a
+ * change, rather than only on its interval or signal.  ‘open’ returns a
+ * descriptor that becomes readable on a change, and may return the same
+ * descriptor for several components; ‘drain’ consumes the pending
+ * notifications and returns whether the components should be updated.
+ */
+typedef struct {
+	void (*update)(char *buf, size_t bufsize, const char *args,
+		       void *state);
+	int (*open)(const char *args);
+	bool (*drain)(int fd);
+} ComponentWatch;
+
+/*
+ * A component that keeps state between updates, such as the counters that
+ * the next delta is taken from.  Each component configured with ‘update’
+ * gets an instance of its own: ‘init’ creates it from the component's args
+ * at startup, returning NULL and setting errno on failure, every update is
+ * passed it, and ‘teardown’ frees it at exit.  Updates of a component are
+ * serialised, so an instance needs no lock.  Stateless components are
+ * passed NULL.
+ */
+typedef struct {
+	void (*update)(char *buf, size_t bufsize, const char *args,
+		       void *state);
+	void *(*init)(const char *args);
+	void (*teardown)(void *state);
+} ComponentInstance;
+
+extern const ComponentWatch component_watches[];
+extern const size_t component_nwatches;
+extern const ComponentInstance component_instances[];
+extern const size_t component_ninstances;
+
+bool component_on_battery(void);
+
+void comp_keyboard_indicator(char *buf, size_t bufsize, const char *args,
+			     void *state);
+void comp_notmuch(char *buf, size_t bufsize, const char *args, void *state);
+void comp_net_traffic(char *buf, size_t bufsize, const char *args, void *state);
+void comp_cpu(char *buf, size_t bufsize, const char *args, void *state);
+void comp_cpu_cores(char *buf, size_t bufsize, const char *args, void *state);
+void comp_memory_available(char *buf, size_t bufsize, const char *args,
+			   void *state);
+void comp_disk_free(char *buf, size_t bufsize, const char *path, void *state);
+void comp_volume(char *buf, size_t bufsize, const char *path, void *state);
+void comp_volume_event(char *buf, size_t bufsize, const char *event,
+		       void *state);
+void comp_stream_line(char *buf, size_t bufsize, const char *line, void *state);
+void comp_wifi(char *buf, size_t bufsize, const char *device, void *state);
+void comp_battery(char *buf, size_t bufsize, const char *args, void *state);
+void comp_datetime(char *buf, size_t bufsize, const char *date_fmt,
+		   void *state);
 
 #endif
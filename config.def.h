@@ -5,20 +5,34 @@
 
 static const char divider_str[] = "   ";
 static const char no_val_str[] = "???";
+/* Shown before the text of a component whose update is overdue */
+static const char stale_str[] = "~";
 const char err_str[] = "err";
 
+/* Changes made within this many ms of each other are shown together */
+static const unsigned frame_coalesce_ms = 50;
+/* Maximum number of times per second the status is updated */
+static const unsigned max_frame_rate = 10;
+/* Failing components are retried at doubling intervals of up to this
+   many seconds */
+static const time_t error_backoff_max = 600;
+/* Factor by which update intervals are stretched while on battery */
+static const time_t battery_stretch = 2;
+/* Threads that run the updates of components with a deadline */
+static const unsigned worker_threads = 2;
+
 /* clang-format off */
 static const ComponentDefn component_defns[] = {
-	/* function,			args,	  	interval,	signal (SIGRTMIN+n) */
-	{ comp_keyboard_indicator,	0,		-1,	 	 0 },
-	{ comp_net_traffic,		"wlan0",	 1,		-1 },
-	{ comp_cpu,			0,		 1,		-1 },
-	{ comp_memory_available,	0,		 2,		-1 },
-	{ comp_disk_free,		"/",		15,		-1 },
-	{ comp_volume,			0,		60,	 	 2 },
-	{ comp_wifi,			"wlan0",	 5,		-1 },
-	{ comp_battery,			0,		 2,		-1 },
-	{ comp_datetime,		"%a %e %b %R",	30,		-1 },
+	/* name,	function,			args,	  	interval,	max interval,	deadline (ms),	signal (SIGRTMIN+n),	flags */
+	{ "keyboard",	comp_keyboard_indicator,	0,		-1,	 	-1,		0,		-1,			COMP_URGENT },
+	{ "net",	comp_net_traffic,		"wlan0",	 1,		 4,		0,		-1,			0 },
+	{ "cpu",	comp_cpu,			"spark",	 1,		 4,		0,		-1,			0 },
+	{ "memory",	comp_memory_available,		0,		 2,		16,		0,		-1,			0 },
+	{ "disk",	comp_disk_free,			"/",		15,		240,		2000,		-1,			0 },
+	{ "volume",	comp_volume_event,		"pactl subscribe",	-1,	-1,		1000,	 	 2,			COMP_STREAM },
+	{ "wifi",	comp_wifi,			"wlan0",	 5,		60,		1000,		-1,			0 },
+	{ "battery",	comp_battery,			0,		60,		600,		0,		-1,			0 },
+	{ "datetime",	comp_datetime,			"%a %e %b %R",	60,		60,		0,		-1,			COMP_ALIGN },
 };
 /* clang-format on */
 
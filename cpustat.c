@@ -0,0 +1,212 @@
+/*
+ * Per-core CPU usage from /proc/stat.  The times of every ‘cpuN’ line are
+ * parsed into a CpuTimes, and the usage of each core since the previous
+ * CpuTimes is computed in one pass, with AVX2 or SSE2 where available.
+ */
+
+#include "cpustat.h"
+
+#include "parse.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Parse the times of every ‘cpuN’ line of ‘stat’ into ‘t’, in the order of
+ * the lines, i.e. of CPU number, and return the number of cores.  As for
+ * the aggregate line, the total is the sum of the first seven fields and
+ * the idle time the fourth.
+ */
+unsigned cpustat_parse(const char *stat, CpuTimes *t)
+{
+	const char *p = stat;
+	uint64_t v[7], cpu;
+	unsigned n = 0;
+
+	while ((p = parse_line(p, "cpu")) && n < CPUSTAT_MAX_CORES) {
+		/* Skip the aggregate line, which has no number */
+		if (*p >= '0' && *p <= '9') {
+			p = parse_u64(p, &cpu);
+			if (parse_u64s(p, v, LEN(v)) != LEN(v))
+				break;
+			t->cpu[n] = (uint32_t)cpu;
+			t->total[n] = (uint32_t)(v[0] + v[1] + v[2] + v[3] +
+						 v[4] + v[5] + v[6]);
+			t->idle[n] = (uint32_t)v[3];
+			n++;
+		}
+		while (*p && *p != '\n')
+			p++;
+	}
+	t->n = n;
+	return n;
+}
+
+/*
+ * Compute the usage of core ‘i’, in percent, and make ‘cur’ its previous
+ * times.  A core with no ticks since then counts as idle.
+ */
+static void usage_one(const CpuTimes *cur, CpuTimes *prev, float *usage,
+		      unsigned i)
+{
+	const uint32_t total = cur->total[i] - prev->total[i];
+	const uint32_t idle = cur->idle[i] - prev->idle[i];
+
+	usage[i] = total ? 100.0f * (float)(total - idle) / (float)total : 0;
+	prev->total[i] = cur->total[i];
+	prev->idle[i] = cur->idle[i];
+}
+
+void cpustat_usage_scalar(const CpuTimes *cur, CpuTimes *prev, float *usage)
+{
+	for (unsigned i = 0; i < cur->n; i++)
+		usage_one(cur, prev, usage, i);
+	prev->n = cur->n;
+}
+
+#if defined(__x86_64__)
+/*
+ * Convert unsigned lanes to float as the scalar cast does.  A plain
+ * conversion would take deltas of 2^31 ticks and more as negative.  Both
+ * halves convert exactly, so the sum is rounded only once.
+ */
+static __m128 cvt_u32_ps(const __m128i v)
+{
+	const __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(v, 16));
+	const __m128 lo =
+		_mm_cvtepi32_ps(_mm_and_si128(v, _mm_set1_epi32(0xffff)));
+
+	return _mm_add_ps(_mm_mul_ps(hi, _mm_set1_ps(65536.0f)), lo);
+}
+
+__attribute__((target("avx2"))) static __m256 cvt_u32_ps256(const __m256i v)
+{
+	const __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16));
+	const __m256 lo = _mm256_cvtepi32_ps(
+		_mm256_and_si256(v, _mm256_set1_epi32(0xffff)));
+
+	return _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+}
+
+void cpustat_usage_sse2(const CpuTimes *cur, CpuTimes *prev, float *usage)
+{
+	const __m128 hundred = _mm_set1_ps(100.0f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i t, i, ct, ci;
+	__m128 busy, pct;
+	unsigned k;
+
+	for (k = 0; k + 4 <= cur->n; k += 4) {
+		ct = _mm_loadu_si128((const __m128i *)&cur->total[k]);
+		ci = _mm_loadu_si128((const __m128i *)&cur->idle[k]);
+		t = _mm_sub_epi32(ct, _mm_loadu_si128((__m128i *)&prev->total[k]));
+		i = _mm_sub_epi32(ci, _mm_loadu_si128((__m128i *)&prev->idle[k]));
+		busy = cvt_u32_ps(_mm_sub_epi32(t, i));
+		pct = _mm_div_ps(_mm_mul_ps(busy, hundred), cvt_u32_ps(t));
+		/* Lanes with no ticks divided by zero: make them idle */
+		pct = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(t, zero)),
+				    pct);
+		_mm_storeu_ps(&usage[k], pct);
+		_mm_storeu_si128((__m128i *)&prev->total[k], ct);
+		_mm_storeu_si128((__m128i *)&prev->idle[k], ci);
+	}
+	for (; k < cur->n; k++)
+		usage_one(cur, prev, usage, k);
+	prev->n = cur->n;
+}
+
+__attribute__((target("avx2"))) void
+cpustat_usage_avx2(const CpuTimes *cur, CpuTimes *prev, float *usage)
+{
+	const __m256 hundred = _mm256_set1_ps(100.0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i t, i, ct, ci;
+	__m256 busy, pct;
+	unsigned k;
+
+	for (k = 0; k + 8 <= cur->n; k += 8) {
+		ct = _mm256_loadu_si256((const __m256i *)&cur->total[k]);
+		ci = _mm256_loadu_si256((const __m256i *)&cur->idle[k]);
+		t = _mm256_sub_epi32(
+			ct, _mm256_loadu_si256((__m256i *)&prev->total[k]));
+		i = _mm256_sub_epi32(
+			ci, _mm256_loadu_si256((__m256i *)&prev->idle[k]));
+		busy = cvt_u32_ps256(_mm256_sub_epi32(t, i));
+		pct = _mm256_div_ps(_mm256_mul_ps(busy, hundred),
+				    cvt_u32_ps256(t));
+		pct = _mm256_andnot_ps(
+			_mm256_castsi256_ps(_mm256_cmpeq_epi32(t, zero)), pct);
+		_mm256_storeu_ps(&usage[k], pct);
+		_mm256_storeu_si256((__m256i *)&prev->total[k], ct);
+		_mm256_storeu_si256((__m256i *)&prev->idle[k], ci);
+	}
+	for (; k < cur->n; k++)
+		usage_one(cur, prev, usage, k);
+	prev->n = cur->n;
+}
+#endif
+
+static CpuUsageFn usage_fn = cpustat_usage_scalar;
+static pthread_once_t usage_once = PTHREAD_ONCE_INIT;
+
+static void usage_select(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	usage_fn = __builtin_cpu_supports("avx2") ? cpustat_usage_avx2
+						  : cpustat_usage_sse2;
+#endif
+}
+
+/*
+ * Line the previous times up with the cores of ‘cur’, which differ after a
+ * CPU has gone offline or come back online.  A core without previous times
+ * is given its current ones, so that it shows as idle until the next
+ * update.  Returns the number of cores that had previous times.
+ */
+static unsigned usage_align(const CpuTimes *cur, CpuTimes *prev)
+{
+	const CpuTimes old = *prev;
+	unsigned j = 0, matched = 0;
+
+	for (unsigned i = 0; i < cur->n; i++) {
+		while (j < old.n && old.cpu[j] < cur->cpu[i])
+			j++;
+		if (j < old.n && old.cpu[j] == cur->cpu[i]) {
+			prev->total[i] = old.total[j];
+			prev->idle[i] = old.idle[j];
+			matched++;
+		} else {
+			prev->total[i] = cur->total[i];
+			prev->idle[i] = cur->idle[i];
+		}
+		prev->cpu[i] = cur->cpu[i];
+	}
+	prev->n = cur->n;
+	return matched;
+}
+
+/*
+ * Compute the usage of every core in ‘cur’, in percent, into ‘usage’, and
+ * make ‘cur’ the previous times.  The widest vectors the CPU supports are
+ * used.  Returns false if no core had previous times, e.g. on the first
+ * call, in which case every usage is 0.
+ */
+bool cpustat_usage(const CpuTimes *cur, CpuTimes *prev, float *usage)
+{
+	bool measured = cur->n > 0;
+	int r = pthread_once(&usage_once, usage_select);
+	assert(r == 0);
+
+	if (prev->n != cur->n ||
+	    memcmp(prev->cpu, cur->cpu, cur->n * sizeof(*cur->cpu)) != 0)
+		measured = usage_align(cur, prev) > 0;
+	usage_fn(cur, prev, usage);
+	return measured;
+}
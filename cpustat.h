@@ -0,0 +1,36 @@
+#ifndef CPUSTAT_H
+#define CPUSTAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPUSTAT_MAX_CORES 1024
+
+/*
+ * The cumulative times of every online core, in a structure-of-arrays
+ * layout so that the deltas of many cores can be computed in one vector
+ * operation.  Times are kept modulo 2^32 ticks: deltas between updates are
+ * far below that, and 32-bit lanes double the cores per vector.  Offline
+ * cores are missing from /proc/stat, so each core's CPU number is kept
+ * alongside its times.
+ */
+typedef struct {
+	unsigned n;
+	uint32_t total[CPUSTAT_MAX_CORES];
+	uint32_t idle[CPUSTAT_MAX_CORES];
+	uint32_t cpu[CPUSTAT_MAX_CORES];
+} CpuTimes;
+
+typedef void (*CpuUsageFn)(const CpuTimes *cur, CpuTimes *prev,
+			   float *usage);
+
+unsigned cpustat_parse(const char *stat, CpuTimes *t);
+bool cpustat_usage(const CpuTimes *cur, CpuTimes *prev, float *usage);
+void cpustat_usage_scalar(const CpuTimes *cur, CpuTimes *prev, float *usage);
+#if defined(__x86_64__)
+void cpustat_usage_sse2(const CpuTimes *cur, CpuTimes *prev, float *usage);
+void cpustat_usage_avx2(const CpuTimes *cur, CpuTimes *prev, float *usage);
+#endif
+
+#endif
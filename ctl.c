@@ -0,0 +1,37 @@
+#include "ctl.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/*
+ * Get the path of the runtime file ‘name’: in $XDG_RUNTIME_DIR, which only
+ * its user can write to, or in /tmp if that is not set.
+ */
+bool ctl_path(char *buf, size_t size, const char *name)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+	n = snprintf(buf, size, "%s/%s", dir, name);
+	if (n < 0 || (size_t)n >= size) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Get the address of the control socket, the runtime file ‘mtstatus.sock’.
+ */
+bool ctl_addr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	return ctl_path(addr->sun_path, sizeof(addr->sun_path),
+			"mtstatus.sock");
+}
@@ -0,0 +1,31 @@
+#ifndef CTL_H
+#define CTL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+/*
+ * The control socket, a SOCK_SEQPACKET Unix socket on which mtstatus takes
+ * one command per message and answers each with one message.  Commands:
+ *
+ *   refresh [component]  update a component now, or every component
+ *   pause                stop updating components until resumed
+ *   resume               resume updates and refresh every component
+ *   get [component]      the text of a component, or the whole status
+ *   stats                the statistics of every component
+ *
+ * A component is given by its name in config.h or by its index.  A reply
+ * starts with "ok\n" followed by any output, or with "error: " followed by
+ * a description of the error.
+ */
+
+#define CTL_MAX_MSG 4096
+
+#define CTL_OK	  "ok\n"
+#define CTL_ERROR "error: "
+
+bool ctl_path(char *buf, size_t size, const char *name);
+bool ctl_addr(struct sockaddr_un *addr);
+
+#endif
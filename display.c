@@ -0,0 +1,604 @@
+#include "display.h"
+
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef XLIB
+#include <X11/XKBlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#else
+#include <sys/uio.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xproto.h>
+#endif
+
+/* XKB keyboards have at most four groups (layouts) */
+#define KBD_GROUPS 4
+
+/*
+ * The keyboard state is kept up to date from XKB events as they are
+ * drained from the connection, so reading it never waits on the server.
+ * ‘fd’ is an eventfd that is signalled whenever the state changes.
+ */
+static struct {
+	pthread_mutex_t mtx;
+	bool valid;
+	uint32_t leds;
+	uint32_t caps_mask, num_mask;  // indicator bits of Caps and Num Lock
+	unsigned group;
+	char groups[KBD_GROUPS][sizeof(((KeyboardState *)0)->layout)];
+	int fd;
+} kbd = { .mtx = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static void kbd_lock(void)
+{
+	int r = pthread_mutex_lock(&kbd.mtx);
+	assert(r == 0);
+}
+
+static void kbd_unlock(void)
+{
+	int r = pthread_mutex_unlock(&kbd.mtx);
+	assert(r == 0);
+}
+
+static void kbd_notify(void)
+{
+	const uint64_t one = 1;
+
+	if (kbd.fd >= 0 && write(kbd.fd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		log_errno(errno, "Unable to signal keyboard change");
+}
+
+static void kbd_set_group_name(unsigned group, const char *name, size_t len)
+{
+	if (group >= KBD_GROUPS)
+		return;
+	if (len >= sizeof(kbd.groups[group]))
+		len = sizeof(kbd.groups[group]) - 1;
+	memcpy(kbd.groups[group], name, len);
+	kbd.groups[group][len] = '\0';
+}
+
+#ifdef XLIB
+
+static Display *dpy;
+static Atom net_wm_name, utf8_string;
+static int xkb_event_base = -1;
+
+bool display_open(void)
+{
+	/* Component threads query the keyboard on the same display */
+	if (!XInitThreads())
+		return false;
+	dpy = XOpenDisplay(NULL);
+	if (!dpy)
+		return false;
+	net_wm_name = XInternAtom(dpy, "_NET_WM_NAME", False);
+	utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
+	return true;
+}
+
+void display_close(void)
+{
+	XCloseDisplay(dpy);
+	dpy = NULL;
+}
+
+int display_fd(void)
+{
+	return ConnectionNumber(dpy);
+}
+
+static void kbd_fetch_names(void)
+{
+	const Atom caps = XInternAtom(dpy, "Caps Lock", True);
+	const Atom num = XInternAtom(dpy, "Num Lock", True);
+	XkbDescPtr desc = XkbAllocKeyboard();
+	char *name;
+
+	if (!desc)
+		return;
+	desc->device_spec = XkbUseCoreKbd;
+	if (XkbGetNames(dpy, XkbIndicatorNamesMask | XkbGroupNamesMask,
+			desc) != Success) {
+		XkbFreeKeyboard(desc, 0, True);
+		return;
+	}
+	kbd_lock();
+	kbd.caps_mask = kbd.num_mask = 0;
+	for (unsigned i = 0; i < XkbNumIndicators; i++) {
+		if (desc->names->indicators[i] == None)
+			continue;
+		if (desc->names->indicators[i] == caps)
+			kbd.caps_mask = 1U << i;
+		else if (desc->names->indicators[i] == num)
+			kbd.num_mask = 1U << i;
+	}
+	for (unsigned g = 0; g < KBD_GROUPS; g++) {
+		name = desc->names->groups[g] != None
+			       ? XGetAtomName(dpy, desc->names->groups[g])
+			       : NULL;
+		kbd_set_group_name(g, name ? name : "", name ? strlen(name) : 0);
+		if (name)
+			XFree(name);
+	}
+	kbd_unlock();
+	XkbFreeKeyboard(desc, 0, True);
+}
+
+static bool kbd_open(void)
+{
+	int opcode, error_base, major = XkbMajorVersion,
+				minor = XkbMinorVersion;
+	XkbStateRec state;
+	unsigned leds;
+
+	if (!XkbQueryExtension(dpy, &opcode, &xkb_event_base, &error_base,
+			       &major, &minor))
+		return false;
+	XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbStateNotify,
+			      XkbGroupStateMask, XkbGroupStateMask);
+	XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbNamesNotify,
+			      XkbGroupNamesMask | XkbIndicatorNamesMask,
+			      XkbGroupNamesMask | XkbIndicatorNamesMask);
+	XkbSelectEvents(dpy, XkbUseCoreKbd, XkbIndicatorStateNotifyMask,
+			XkbIndicatorStateNotifyMask);
+
+	kbd_fetch_names();
+	if (XkbGetState(dpy, XkbUseCoreKbd, &state) != Success ||
+	    XkbGetIndicatorState(dpy, XkbUseCoreKbd, &leds) != Success)
+		return false;
+	kbd_lock();
+	kbd.group = state.group;
+	kbd.leds = leds;
+	kbd.valid = true;
+	kbd_unlock();
+	return true;
+}
+
+static void kbd_event(const XkbEvent *ev)
+{
+	switch (ev->any.xkb_type) {
+	case XkbStateNotify:
+		kbd_lock();
+		kbd.group = (unsigned)ev->state.group;
+		kbd_unlock();
+		break;
+	case XkbIndicatorStateNotify:
+		kbd_lock();
+		kbd.leds = ev->indicators.state;
+		kbd_unlock();
+		break;
+	case XkbNamesNotify:
+		kbd_fetch_names();
+		break;
+	default:
+		return;
+	}
+	kbd_notify();
+}
+
+bool display_drain(void)
+{
+	XEvent ev;
+
+	while (XPending(dpy) > 0) {
+		XNextEvent(dpy, &ev);
+		if (xkb_event_base >= 0 && ev.type == xkb_event_base)
+			kbd_event((const XkbEvent *)&ev);
+	}
+	return true;
+}
+
+void display_set_name(const char *name)
+{
+	Window root = DefaultRootWindow(dpy);
+
+	XStoreName(dpy, root, name);
+	if (name)
+		XChangeProperty(dpy, root, net_wm_name, utf8_string, 8,
+				PropModeReplace, (const unsigned char *)name,
+				(int)strlen(name));
+	else
+		XDeleteProperty(dpy, root, net_wm_name);
+	XFlush(dpy);
+}
+
+#else
+
+/*
+ * A single connection is used from every thread; XCB serialises requests
+ * internally, so no global lock is needed.  Property updates are sent
+ * without waiting for a reply, and any error they cause arrives as an
+ * event that display_drain() logs.
+ */
+static xcb_connection_t *conn;
+static xcb_window_t root;
+static xcb_atom_t net_wm_name, utf8_string;
+
+/*
+ * The few XKB requests needed are encoded here rather than through
+ * libxcb-xkb.  Values are from the X Keyboard Extension protocol
+ * specification.
+ */
+static xcb_extension_t xkb_ext = { "XKEYBOARD", 0 };
+static int xkb_first_event = -1;
+
+enum {
+	XKB_USE_EXTENSION = 0,
+	XKB_SELECT_EVENTS = 1,
+	XKB_GET_STATE = 4,
+	XKB_GET_INDICATOR_STATE = 12,
+	XKB_GET_NAMES = 17,
+};
+
+enum {
+	XKB_STATE_NOTIFY = 2,
+	XKB_INDICATOR_STATE_NOTIFY = 4,
+	XKB_NAMES_NOTIFY = 6,
+};
+
+#define XKB_USE_CORE_KBD      0x0100
+#define XKB_GROUP_STATE	      0x0010
+#define XKB_INDICATOR_NAMES   0x0100
+#define XKB_GROUP_NAMES	      0x1000
+#define XKB_MAX_INDICATORS    32
+
+static xcb_atom_t intern_reply(xcb_intern_atom_cookie_t cookie)
+{
+	xcb_intern_atom_reply_t *reply;
+	xcb_atom_t atom;
+
+	reply = xcb_intern_atom_reply(conn, cookie, NULL);
+	if (!reply)
+		return XCB_ATOM_NONE;
+	atom = reply->atom;
+	free(reply);
+	return atom;
+}
+
+bool display_open(void)
+{
+	xcb_intern_atom_cookie_t name_cookie, utf8_cookie;
+	const xcb_setup_t *setup;
+	xcb_screen_iterator_t it;
+	int screen;
+
+	conn = xcb_connect(NULL, &screen);
+	if (xcb_connection_has_error(conn)) {
+		xcb_disconnect(conn);
+		conn = NULL;
+		return false;
+	}
+	setup = xcb_get_setup(conn);
+	for (it = xcb_setup_roots_iterator(setup); screen > 0; screen--)
+		xcb_screen_next(&it);
+	root = it.data->root;
+
+	/* Send both requests before waiting for either reply */
+	name_cookie = xcb_intern_atom(conn, 0, strlen("_NET_WM_NAME"),
+				      "_NET_WM_NAME");
+	utf8_cookie = xcb_intern_atom(conn, 0, strlen("UTF8_STRING"),
+				      "UTF8_STRING");
+	net_wm_name = intern_reply(name_cookie);
+	utf8_string = intern_reply(utf8_cookie);
+	return true;
+}
+
+void display_close(void)
+{
+	xcb_disconnect(conn);
+	conn = NULL;
+}
+
+int display_fd(void)
+{
+	return xcb_get_file_descriptor(conn);
+}
+
+/*
+ * Send an XKB request of ‘len’ bytes, starting with the four byte header
+ * that XCB fills in, and return its sequence number.
+ */
+static unsigned xkb_send(void *req, size_t len, uint8_t opcode, bool isvoid)
+{
+	xcb_protocol_request_t proto = {
+		.count = 2, .ext = &xkb_ext, .opcode = opcode, .isvoid = isvoid
+	};
+	struct iovec parts[4];
+
+	parts[2].iov_base = req;
+	parts[2].iov_len = len;
+	parts[3].iov_base = NULL;
+	parts[3].iov_len = -len & 3;
+	return xcb_send_request(conn, 0, parts + 2, &proto);
+}
+
+static uint8_t *xkb_reply(unsigned seq)
+{
+	xcb_generic_error_t *e = NULL;
+	uint8_t *reply = xcb_wait_for_reply(conn, seq, &e);
+
+	if (e) {
+		log_err("X error %u for XKB request %u", e->error_code,
+			e->minor_code);
+		free(e);
+	}
+	return reply;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Fetch the names of the indicators and groups.  The requests are all sent
+ * before waiting for the replies, so this costs two round trips.
+ */
+static void kbd_fetch_names(void)
+{
+	struct {
+		uint16_t header[2];
+		uint16_t device_spec, pad;
+		uint32_t which;
+	} names_req = { .device_spec = XKB_USE_CORE_KBD,
+			.which = XKB_INDICATOR_NAMES | XKB_GROUP_NAMES };
+	xcb_intern_atom_cookie_t caps_cookie, num_cookie;
+	xcb_get_atom_name_cookie_t cookies[KBD_GROUPS] = { { 0 } };
+	xcb_get_atom_name_reply_t *name;
+	xcb_atom_t caps, num, atom;
+	const uint8_t *atoms;
+	uint8_t *reply;
+	uint32_t indicators;
+	unsigned seq, group_mask, n = 0;
+
+	caps_cookie = xcb_intern_atom(conn, 1, strlen("Caps Lock"),
+				      "Caps Lock");
+	num_cookie = xcb_intern_atom(conn, 1, strlen("Num Lock"), "Num Lock");
+	seq = xkb_send(&names_req, sizeof(names_req), XKB_GET_NAMES, false);
+	caps = intern_reply(caps_cookie);
+	num = intern_reply(num_cookie);
+	reply = xkb_reply(seq);
+	if (!reply)
+		return;
+
+	/* Indicator names come before group names in the value list */
+	indicators = get32(reply + 20);
+	group_mask = reply[15];
+	atoms = reply + 32;
+
+	kbd_lock();
+	kbd.caps_mask = kbd.num_mask = 0;
+	for (unsigned i = 0; i < XKB_MAX_INDICATORS; i++) {
+		if (!(indicators & (1U << i)))
+			continue;
+		atom = get32(atoms + 4 * n++);
+		if (atom != XCB_ATOM_NONE && atom == caps)
+			kbd.caps_mask = 1U << i;
+		else if (atom != XCB_ATOM_NONE && atom == num)
+			kbd.num_mask = 1U << i;
+	}
+	kbd_unlock();
+
+	for (unsigned g = 0; g < KBD_GROUPS; g++) {
+		if (group_mask & (1U << g))
+			cookies[g] = xcb_get_atom_name(conn,
+						       get32(atoms + 4 * n++));
+	}
+	free(reply);
+
+	for (unsigned g = 0; g < KBD_GROUPS; g++) {
+		name = cookies[g].sequence
+			       ? xcb_get_atom_name_reply(conn, cookies[g], NULL)
+			       : NULL;
+		kbd_lock();
+		if (name)
+			kbd_set_group_name(
+				g, xcb_get_atom_name_name(name),
+				(size_t)xcb_get_atom_name_name_length(name));
+		else
+			kbd_set_group_name(g, "", 0);
+		kbd_unlock();
+		free(name);
+	}
+}
+
+static bool kbd_open(void)
+{
+	uint16_t use_req[4] = { 0, 0, 1, 0 };  // XKB 1.0
+	uint16_t state_req[4] = { 0, 0, XKB_USE_CORE_KBD, 0 };
+	/* Select every indicator state change, and only group changes of
+	   the keyboard state and names */
+	uint16_t select_req[12] = {
+		0, 0, XKB_USE_CORE_KBD,
+		1U << XKB_STATE_NOTIFY | 1U << XKB_INDICATOR_STATE_NOTIFY |
+			1U << XKB_NAMES_NOTIFY,
+		0, 1U << XKB_INDICATOR_STATE_NOTIFY, 0, 0,
+		XKB_GROUP_STATE, XKB_GROUP_STATE,
+		XKB_INDICATOR_NAMES | XKB_GROUP_NAMES,
+		XKB_INDICATOR_NAMES | XKB_GROUP_NAMES
+	};
+	const xcb_query_extension_reply_t *ext;
+	uint8_t *state, *leds;
+	unsigned state_seq, leds_seq;
+	bool valid;
+
+	ext = xcb_get_extension_data(conn, &xkb_ext);
+	if (!ext || !ext->present)
+		return false;
+	state = xkb_reply(xkb_send(use_req, sizeof(use_req),
+				   XKB_USE_EXTENSION, false));
+	if (!state || !state[1]) {
+		free(state);
+		return false;
+	}
+	free(state);
+	xkb_first_event = ext->first_event;
+
+	xkb_send(select_req, sizeof(select_req), XKB_SELECT_EVENTS, true);
+	kbd_fetch_names();
+	state_seq = xkb_send(state_req, sizeof(state_req), XKB_GET_STATE,
+			     false);
+	leds_seq = xkb_send(state_req, sizeof(state_req),
+			    XKB_GET_INDICATOR_STATE, false);
+	state = xkb_reply(state_seq);
+	leds = xkb_reply(leds_seq);
+	valid = state && leds;
+	if (valid) {
+		kbd_lock();
+		kbd.group = state[12];
+		kbd.leds = get32(leds + 8);
+		kbd.valid = true;
+		kbd_unlock();
+	}
+	free(state);
+	free(leds);
+	return valid;
+}
+
+static void kbd_event(const uint8_t *ev)
+{
+	switch (ev[1]) {
+	case XKB_STATE_NOTIFY:
+		kbd_lock();
+		kbd.group = ev[13];
+		kbd_unlock();
+		break;
+	case XKB_INDICATOR_STATE_NOTIFY:
+		kbd_lock();
+		kbd.leds = get32(ev + 12);
+		kbd_unlock();
+		break;
+	case XKB_NAMES_NOTIFY:
+		kbd_fetch_names();
+		break;
+	default:
+		return;
+	}
+	kbd_notify();
+}
+
+/*
+ * Consume the events and errors queued on the connection.  Returns false
+ * once the connection to the X server has been lost.
+ */
+bool display_drain(void)
+{
+	xcb_generic_event_t *ev;
+
+	while ((ev = xcb_poll_for_event(conn)) != NULL) {
+		if (ev->response_type == 0) {
+			const xcb_generic_error_t *e =
+				(const xcb_generic_error_t *)ev;
+			log_err("X error %u for request %u.%u", e->error_code,
+				e->major_code, e->minor_code);
+		} else if ((ev->response_type & 0x7f) == xkb_first_event) {
+			kbd_event((const uint8_t *)ev);
+		}
+		free(ev);
+	}
+	return !xcb_connection_has_error(conn);
+}
+
+void display_set_name(const char *name)
+{
+	const uint32_t len = name ? (uint32_t)strlen(name) : 0;
+
+	/* WM_NAME is typed as STRING, as XStoreName() would, although the
+	   text is UTF-8: that is what dwm expects */
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, root,
+			    XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, len,
+			    name ? name : "");
+	if (net_wm_name != XCB_ATOM_NONE && utf8_string != XCB_ATOM_NONE) {
+		if (name)
+			xcb_change_property(conn, XCB_PROP_MODE_REPLACE,
+					    root, net_wm_name, utf8_string, 8,
+					    len, name);
+		else
+			xcb_delete_property(conn, root, net_wm_name);
+	}
+	xcb_flush(conn);
+}
+
+#endif
+
+/*
+ * Start following the keyboard state through XKB events, and return a
+ * descriptor that becomes readable when it changes.
+ */
+int display_keyboard_monitor(void)
+{
+#ifdef XLIB
+	const bool connected = dpy != NULL;
+#else
+	const bool connected = conn != NULL;
+#endif
+
+	if (kbd.fd >= 0)
+		return kbd.fd;
+	if (!connected) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	kbd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (kbd.fd < 0)
+		return -1;
+	if (!kbd_open()) {
+		(void)close(kbd.fd);
+		kbd.fd = -1;
+		errno = ENOTSUP;
+		return -1;
+	}
+	/* Have the initial state shown */
+	kbd_notify();
+	return kbd.fd;
+}
+
+bool display_keyboard_drain(const int fd)
+{
+	uint64_t n;
+
+	return read(fd, &n, sizeof(n)) == sizeof(n);
+}
+
+/*
+ * Copy the last reported keyboard state into ‘kb’.  Returns false if the
+ * state is not known.
+ */
+bool display_keyboard_get(KeyboardState *kb)
+{
+	bool valid;
+
+	if (trace_mode == TRACE_REPLAY)
+		return trace_replay_io(TRACE_KEYBOARD, "", kb, sizeof(*kb)) > 0;
+
+	kbd_lock();
+	valid = kbd.valid;
+	if (valid) {
+		kb->caps = kbd.leds & kbd.caps_mask;
+		kb->num = kbd.leds & kbd.num_mask;
+		memcpy(kb->layout, kbd.groups[kbd.group % KBD_GROUPS],
+		       sizeof(kb->layout));
+	}
+	kbd_unlock();
+	trace_io(TRACE_KEYBOARD, "", kb, valid ? sizeof(*kb) : 0, valid);
+	return valid;
+}
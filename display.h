@@ -0,0 +1,29 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdbool.h>
+
+/*
+ * Output of the status text to the X root window name, and keyboard state
+ * from the XKB extension.  The default backend speaks XCB; building with
+ * -DXLIB selects the original Xlib one.
+ */
+
+bool display_open(void);
+void display_close(void);
+int display_fd(void);
+bool display_drain(void);
+void display_set_name(const char *name);
+
+/* Keyboard state as last reported by XKB */
+typedef struct {
+	bool caps;
+	bool num;
+	char layout[64];  // name of the active group, e.g. "English (US)"
+} KeyboardState;
+
+int display_keyboard_monitor(void);
+bool display_keyboard_drain(int fd);
+bool display_keyboard_get(KeyboardState *kb);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Fixed-memory history of a series of samples.  Every sample is pushed
+ * into level 0, and every HISTORY_FACTOR buckets of a level are combined
+ * into one bucket of the next, so that long windows are kept at a coarser
+ * resolution in the same space.  The running minimum, maximum and EWMA
+ * are maintained as samples arrive rather than recomputed, and the
+ * sparkline is only redrawn when a bucket of the level it shows completes.
+ */
+
+#include "history.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+
+static const char *const bars[] = { "▁", "▂", "▃", "▄",
+				    "▅", "▆", "▇", "█" };
+
+/*
+ * Combine buckets with ‘agg’, weigh each sample by ‘alpha’ in the EWMA and
+ * draw the level ‘shown’ as the sparkline.
+ */
+void history_init(History *h, HistoryAgg agg, float alpha, unsigned shown)
+{
+	assert(shown < HISTORY_LEVELS);
+	memset(h, 0, sizeof(*h));
+	h->agg = agg;
+	h->alpha = alpha;
+	h->shown = shown;
+	h->stale = true;
+}
+
+static void level_push(HistoryLevel *lv, float x)
+{
+	const uint32_t s = lv->seq++;
+	unsigned back;
+
+	lv->v[s % HISTORY_SLOTS] = x;
+
+	/* At most one bucket, the oldest, leaves the window per push */
+	if (lv->min_len && s - lv->minq[lv->min_head] >= HISTORY_SLOTS) {
+		lv->min_head = (lv->min_head + 1) % HISTORY_SLOTS;
+		lv->min_len--;
+	}
+	if (lv->max_len && s - lv->maxq[lv->max_head] >= HISTORY_SLOTS) {
+		lv->max_head = (lv->max_head + 1) % HISTORY_SLOTS;
+		lv->max_len--;
+	}
+
+	/* Buckets older than ‘x’ and no smaller can never be the minimum */
+	while (lv->min_len) {
+		back = (lv->min_head + lv->min_len - 1) % HISTORY_SLOTS;
+		if (lv->v[lv->minq[back] % HISTORY_SLOTS] < x)
+			break;
+		lv->min_len--;
+	}
+	lv->minq[(lv->min_head + lv->min_len++) % HISTORY_SLOTS] = s;
+
+	while (lv->max_len) {
+		back = (lv->max_head + lv->max_len - 1) % HISTORY_SLOTS;
+		if (lv->v[lv->maxq[back] % HISTORY_SLOTS] > x)
+			break;
+		lv->max_len--;
+	}
+	lv->maxq[(lv->max_head + lv->max_len++) % HISTORY_SLOTS] = s;
+}
+
+void history_push(History *h, float sample)
+{
+	HistoryLevel *lv;
+	float x = sample;
+
+	h->ewma = h->level[0].seq ? h->ewma + h->alpha * (sample - h->ewma)
+				  : sample;
+
+	for (unsigned l = 0; l < HISTORY_LEVELS; l++) {
+		lv = &h->level[l];
+		level_push(lv, x);
+		if (l == h->shown)
+			h->stale = true;
+		if (l == HISTORY_LEVELS - 1)
+			break;
+
+		if (lv->acc_n == 0)
+			lv->acc = x;
+		else if (h->agg == HISTORY_MAX)
+			lv->acc = x > lv->acc ? x : lv->acc;
+		else
+			lv->acc += x;
+		if (++lv->acc_n < HISTORY_FACTOR)
+			break;
+		x = h->agg == HISTORY_MEAN ? lv->acc / HISTORY_FACTOR : lv->acc;
+		lv->acc_n = 0;
+	}
+}
+
+/* The smallest bucket in the window of ‘level’, or 0 if it is empty */
+float history_min(const History *h, unsigned level)
+{
+	const HistoryLevel *lv = &h->level[level];
+
+	return lv->min_len ? lv->v[lv->minq[lv->min_head] % HISTORY_SLOTS] : 0;
+}
+
+/* The largest bucket in the window of ‘level’, or 0 if it is empty */
+float history_max(const History *h, unsigned level)
+{
+	const HistoryLevel *lv = &h->level[level];
+
+	return lv->max_len ? lv->v[lv->maxq[lv->max_head] % HISTORY_SLOTS] : 0;
+}
+
+float history_ewma(const History *h)
+{
+	return h->ewma;
+}
+
+/*
+ * Return the buckets of the level shown as a sparkline, oldest first and
+ * padded on the left to HISTORY_SLOTS characters.  The bars are scaled
+ * from zero, or from the minimum if a bucket is negative, to the maximum
+ * of the window.  The string is cached until a bucket next completes.
+ */
+const char *history_spark(History *h)
+{
+	const HistoryLevel *lv = &h->level[h->shown];
+	const unsigned n = lv->seq < HISTORY_SLOTS ? lv->seq : HISTORY_SLOTS;
+	const float lo = history_min(h, h->shown) < 0 ? history_min(h, h->shown)
+						      : 0;
+	const float range = history_max(h, h->shown) - lo;
+	char *p = h->spark, *const end = h->spark + sizeof(h->spark) - 1;
+	unsigned level;
+
+	if (!h->stale)
+		return h->spark;
+
+	for (unsigned i = n; i < HISTORY_SLOTS; i++)
+		p = util_cat(p, end, " ");
+	for (uint32_t s = lv->seq - n; s != lv->seq; s++) {
+		level = range > 0 ? (unsigned)((lv->v[s % HISTORY_SLOTS] - lo) *
+					       LEN(bars) / range)
+				  : 0;
+		if (level >= LEN(bars))
+			level = LEN(bars) - 1;
+		p = util_cat(p, end, bars[level]);
+	}
+	*p = '\0';
+	h->stale = false;
+	return h->spark;
+}
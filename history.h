@@ -0,0 +1,57 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Buckets kept, and drawn as a sparkline, at each level */
+#define HISTORY_SLOTS 16
+/* Levels of downsampling; level 0 holds the samples themselves */
+#define HISTORY_LEVELS 4
+/* Buckets of a level that make up one bucket of the next */
+#define HISTORY_FACTOR 8
+
+/* How the buckets of a level are combined into one of the next */
+typedef enum {
+	HISTORY_MEAN,
+	HISTORY_MAX,  // keeps short spikes visible in long windows
+} HistoryAgg;
+
+/*
+ * A ring of the last HISTORY_SLOTS buckets, with monotonic queues of the
+ * sequence numbers of the buckets that are, or may yet become, the
+ * minimum and maximum of the window, so that both are kept in amortised
+ * O(1) per push.
+ */
+typedef struct {
+	float v[HISTORY_SLOTS];
+	uint32_t seq;  // buckets ever pushed; the newest is seq - 1
+	uint32_t minq[HISTORY_SLOTS], maxq[HISTORY_SLOTS];
+	unsigned min_head, min_len, max_head, max_len;
+	float acc;  // the bucket of the next level being filled
+	unsigned acc_n;
+} HistoryLevel;
+
+/*
+ * The history of one series of samples.  With the defaults, 16 buckets at
+ * four levels cover 16, 128, 1024 and 8192 samples, i.e. over two hours of
+ * one-second samples, in under 1 KiB that is never reallocated.
+ */
+typedef struct {
+	HistoryAgg agg;
+	float alpha;  // weight of a new sample in the EWMA
+	float ewma;
+	unsigned shown;	 // level drawn by history_spark()
+	bool stale;	 // a bucket of ‘shown’ completed since it was drawn
+	HistoryLevel level[HISTORY_LEVELS];
+	char spark[HISTORY_SLOTS * (sizeof("█") - 1) + 1];
+} History;
+
+void history_init(History *h, HistoryAgg agg, float alpha, unsigned shown);
+void history_push(History *h, float sample);
+float history_min(const History *h, unsigned level);
+float history_max(const History *h, unsigned level);
+float history_ewma(const History *h);
+const char *history_spark(History *h);
+
+#endif
@@ -1,319 +1,2349 @@
 #include "mtstatus.h"
 
+#include "component.h"
+#include "ctl.h"
+#include "display.h"
+#include "pool.h"
+#include "trace.h"
 #include "util.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define _POSIX_C_SOURCE 200809L
+#ifdef THREADED
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
 
 #define N_COMPONENTS ((sizeof component_defns) / (sizeof(ComponentDefn)))
 #define MAX_COMP_LEN 128
+/* Room for an i3bar block holding MAX_COMP_LEN bytes of escaped text */
+#define JSON_BLOCK_LEN (6 * MAX_COMP_LEN + 128)
+
+/* Words in the bitmask of components with new text */
+#define DIRTY_WORDS ((UINT8_MAX + 64) / 64)
 
 /*
  * Function that returns an updated value for a status bar component.
+ * ‘state’ is the component's instance (see ComponentInstance), or NULL.
+ */
+typedef void (*SBarUpdater)(char *buf, const size_t bufsize, const char *args,
+			    void *state);
+
+/*
+ * Component flags.
+ */
+enum {
+	/* Update on wall-clock multiples of the interval, e.g. on the minute */
+	COMP_ALIGN = 1 << 0,
+	/* Run ‘args’ as a long-lived shell command and update the component
+	   with each line it prints (see struct stream) */
+	COMP_STREAM = 1 << 1,
+	/* Show changes at once, bypassing frame coalescing */
+	COMP_URGENT = 1 << 2,
+	/* Show each line that clients write to the FIFO at ‘args’, which is
+	   created if need be.  A positive interval is instead the number of
+	   seconds after which the text expires to ‘no_val_str’.  Combine
+	   with COMP_URGENT to show each line at once. */
+	COMP_PUSH = 1 << 3,
+};
+
+/*
+ * Outcomes of an update, which drive the adaptive interval of a component.
  */
-typedef void (*SBarUpdater)(char *buf, const size_t bufsize, const char *args);
+enum {
+	UPDATE_CHANGED = 1 << 0,
+	UPDATE_ERROR = 1 << 1,
+	UPDATE_SKIPPED = 1 << 2,  // updates are paused
+};
 
 typedef struct sbar_comp_defn ComponentDefn;
 
+/*
+ * A component with a ‘max_interval’ greater than its ‘interval’ has an
+ * adaptive interval: it is doubled, up to ‘max_interval’, each time an
+ * update leaves the text unchanged, and drops back to ‘interval’ when the
+ * text changes.  Aligned components keep their interval.
+ *
+ * A component with a ‘deadline_ms’ may block, and is updated on the worker
+ * pool rather than in the thread that schedules it.  If an update has not
+ * returned that many ms after it was queued, the text is shown after
+ * ‘stale_str’ until it does, and the updates asked for meanwhile are run
+ * as one once it has returned.  The lines of a stream are passed to its
+ * pooled updates too, the newest replacing any still waiting to be.
+ */
 struct sbar_comp_defn {
+	const char *name;  // for the control socket (see ctl.h)
 	const SBarUpdater update;
 	const char *args;
 	const time_t interval;
+	const time_t max_interval;
+	const unsigned deadline_ms;
 	const int signum;
+	const unsigned flags;
 };
 
 typedef struct component Component;
 typedef struct sbar StatusBar;
+typedef struct stream Stream;
+
+/*
+ * Update latencies are counted in buckets of powers of two: bucket 0 holds
+ * those under 2^STATS_MIN_SHIFT ns, bucket b those under
+ * 2^(STATS_MIN_SHIFT + b) ns, and the last bucket all longer ones.
+ */
+#define STATS_MIN_SHIFT 10  // 1 µs
+#define STATS_BUCKETS	24  // up to 8.6 s
+
+/* An update that spends longer than this off the CPU counts as a stall */
+#define STATS_STALL_NS 1000000
+
+/*
+ * Statistics of a component's updates.  They are only written by the
+ * thread updating the component, under its lock, so they need no
+ * read-modify-write; they are atomic so that they can be read at any time
+ * without taking that lock.
+ */
+typedef struct {
+	atomic_uint_fast64_t updates;
+	atomic_uint_fast64_t errors;  // updates that logged an error
+	atomic_uint_fast64_t stalls;
+	atomic_uint_fast64_t wall_ns;
+	atomic_uint_fast64_t cpu_ns;
+	atomic_uint_fast64_t min_ns;
+	atomic_uint_fast64_t max_ns;
+	atomic_int_fast64_t last_ok;  // when the last update without errors ended
+	atomic_uint_fast64_t hist[STATS_BUCKETS];
+} Stats;
 
 struct component {
 	unsigned id;
+	const char *name;
 	char *buf;
+	atomic_uint seq;       // sequence lock for ‘buf’ (see sbar_comp_read)
+	pthread_mutex_t lock;  // serialises updates of this component
 	SBarUpdater update;
 	const char *args;
+	void *state;  // the instance of a stateful component, or NULL
+	void (*teardown)(void *state);
 	time_t interval;
+	time_t max_interval;
+	_Atomic time_t cur_interval;  // the interval until the next update
+	unsigned deadline_ms;
+	PoolJob job;		  // the update on the worker pool
+	atomic_uint last_outcome;  // of the last update run on the pool
+	atomic_bool stale;	  // that update is past its deadline
 	int signum;
+	unsigned flags;
+	size_t seg_off;	 // offset of the component's segment in the status
+	size_t seg_len;	 // length of its text plus the following divider
+	int watch_fd;
+	Stream *stream;
+#ifndef THREADED
+	int64_t due;  // when the next scheduled update is due, or 0
+#endif
+	char *block;  // the i3bar block for the text, with -j
+	size_t block_len;
+	Stats stats;
+#ifdef THREADED
 	pthread_t thr_repeating;
 	pthread_t thr_async;
+#endif
+	StatusBar *sbar;
+};
+
+typedef struct watch Watch;
+typedef struct notifier Notifier;
+
+/*
+ * A file descriptor watched by the engine; ‘handle’ is called whenever it
+ * becomes readable.  The event loop registers it in its epoll set, with the
+ * epoll data pointing to the Watch.  The threaded engine polls it from a
+ * thread of its own.
+ */
+struct watch {
+	int fd;
+	void (*handle)(StatusBar *sbar, Watch *w);
+#ifdef THREADED
 	StatusBar *sbar;
+	pthread_t thread;
+#endif
+};
+
+/*
+ * A change notification descriptor (see ComponentWatch) shared by every
+ * component whose ‘watch_fd’ it is.
+ */
+struct notifier {
+	Watch watch;
+	bool (*drain)(int fd);
+};
+
+/* Restart delays for a stream whose producer exits, in seconds */
+#define STREAM_MIN_BACKOFF 1
+#define STREAM_MAX_BACKOFF 64
+
+/* Longest line of a stream, including the newline */
+#define STREAM_LINE_LEN 512
+
+/*
+ * A component fed by a long-running producer process.  The producer is
+ * started once, and every complete line it prints is passed to the
+ * component's update function in place of its args; at other times
+ * (initially and on its signal) the update function is passed "".  If the
+ * producer exits it is restarted, after a delay that doubles each time it
+ * exits early.
+ *
+ * A push component (COMP_PUSH) is a stream read from a FIFO instead.  The
+ * FIFO is opened for writing as well as reading, so that it never reaches
+ * end-of-file when a client closes it, and lines of up to PIPE_BUF bytes
+ * from concurrent clients are never interleaved.
+ */
+struct stream {
+	Watch watch;  // the read end of the producer's stdout, or the FIFO
+	int pidfd;
+	const char *cmd;  // the producer's command, or the FIFO's path
+	bool push;
+	Component *c;
+	char line[STREAM_LINE_LEN];
+	size_t len;
+	bool overflow;
+	time_t started;
+	unsigned backoff;
+	time_t ttl;	  // seconds a pushed line is shown, or 0 for ever
+	int64_t expires;  // when the last pushed line expires, or 0
+	pthread_mutex_t job_lock;  // guards ‘job_line’
+	char job_line[STREAM_LINE_LEN];	 // the line for the pooled update
+#ifdef THREADED
+	pthread_t thread;
+#else
+	Watch restart;	// timerfd that restarts the producer
+	Watch expire;	// timerfd that expires a pushed line
+#endif
+};
+
+#ifndef THREADED
+/* Scheduled updates due within this of each other share a wakeup */
+#define SCHED_SLACK_NS INT64_C(100000000)
+
+typedef struct timer Timer;
+
+/*
+ * A timerfd shared by every component that has the same update interval and
+ * alignment.
+ */
+struct timer {
+	Watch watch;
+	time_t interval;
+	bool align;
+};
+#endif
+
+struct sbar {
+	char *comp_bufs;
+	uint8_t ncomponents;
+	Component *components;
+	Stream *streams;
+	_Atomic uint64_t dirty[DIRTY_WORDS];  // components with new text
+	atomic_bool pending;		      // some dirty bit may be set
+	atomic_bool urgent;		      // an urgent component changed
+	_Atomic int64_t dirty_since;  // when the oldest pending change was made
+	int wakefd;		      // eventfd that wakes the flusher
+	char *status;		      // the assembled status text
+	size_t status_len;
+	int64_t last_frame;  // when the status was last output
+	sigset_t sigset;
+	Notifier *notifiers;
+	unsigned nnotifiers;
+	Watch display;
+	Watch ctl;	      // listening control socket
+	atomic_bool paused;  // updates are paused by the control socket
+	char *blocks;
+	bool json_started;  // the first i3bar frame has been output
+	Watch clicks;	    // i3bar click events on stdin
+	char click_buf[1024];
+	size_t click_len;
+	atomic_uint_fast64_t wakeups;  // times a thread of ours woke up
+	int64_t started;
+	Pool pool;  // for components with a deadline, if there are any
+	bool pooled;
+#ifdef THREADED
+	pthread_t thread;
+#else
+	int epfd;
+	Watch sigwatch;
+	Watch wake;
+	Watch frame_timer;
+	Watch sched;  // timerfd for the next update that is due
+	Timer *timers;
+	unsigned ntimers;
+	int quit_sig;
+#endif
 };
 
-struct sbar {
-	char *comp_bufs;
-	uint8_t ncomponents;
-	Component *components;
-	bool dirty;
-	pthread_mutex_t mutex;
-	pthread_cond_t dirty_cond;
-	pthread_t thread;
-};
+#include "config.h"
+
+static char pidfile[PATH_MAX];
+static char ctl_sock[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+static bool to_stdout = false;
+static bool to_json = false;
+
+static void fatal(int code)
+{
+	log_err("mtstatus: fatal: %s", strerror(code));
+	if (!to_stdout && remove(pidfile) < 0) {
+		log_err("Unable to remove %s", pidfile);
+	}
+	if (*ctl_sock)
+		(void)unlink(ctl_sock);
+	exit(EXIT_FAILURE);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Return the time at which pending changes are due to be output.  Changes
+ * arriving within ‘frame_coalesce_ms’ of the first are gathered into one
+ * frame, and frames are at least 1/‘max_frame_rate’ seconds apart, unless
+ * an urgent component has changed.
+ */
+static int64_t sbar_frame_due(StatusBar *sbar)
+{
+	int64_t due = atomic_load(&sbar->dirty_since) +
+		      frame_coalesce_ms * INT64_C(1000000);
+	int64_t next = sbar->last_frame + INT64_C(1000000000) / max_frame_rate;
+
+	if (atomic_load(&sbar->urgent))
+		return 0;
+	return due > next ? due : next;
+}
+
+/*
+ * Copy the text of a component into ‘buf’.  Text is published under a
+ * sequence lock: the writer makes the sequence number odd while it copies
+ * in new text, and a reader retries if the number was odd or changed
+ * during its own copy.  Neither side ever blocks the other.
+ */
+static void sbar_comp_read(Component *c, char *buf)
+{
+	unsigned seq;
+
+	do {
+		while ((seq = atomic_load_explicit(
+				&c->seq, memory_order_acquire)) &
+		       1)
+			;
+		memcpy(buf, c->buf, MAX_COMP_LEN);
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&c->seq, memory_order_relaxed) != seq);
+}
+
+/* Room for the text of a component as it is shown (see sbar_comp_shown) */
+#define SHOWN_LEN (MAX_COMP_LEN + sizeof(stale_str) - 1)
+
+/*
+ * Copy the text of a component as it is shown into ‘buf’, of SHOWN_LEN
+ * bytes: after ‘stale_str’ while an update on the worker pool is overdue.
+ */
+static void sbar_comp_shown(Component *c, char *buf)
+{
+	size_t n = 0;
+
+	if (atomic_load(&c->stale)) {
+		n = sizeof(stale_str) - 1;
+		memcpy(buf, stale_str, n);
+	}
+	sbar_comp_read(c, buf + n);
+}
+
+static void sbar_comp_publish(Component *c, const char *text)
+{
+	unsigned seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(c->buf, text, MAX_COMP_LEN);
+	atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+static void sbar_wake(StatusBar *sbar)
+{
+	const uint64_t one = 1;
+
+	if (write(sbar->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fatal(errno);
+}
+
+/*
+ * Mark a component as having new text, and wake the flusher if this is the
+ * first pending change or the component is urgent.
+ */
+static void sbar_comp_mark_dirty(Component *c)
+{
+	StatusBar *sbar = c->sbar;
+	const bool urgent = c->flags & COMP_URGENT;
+
+	atomic_fetch_or(&sbar->dirty[c->id / 64], UINT64_C(1) << (c->id % 64));
+	if (urgent)
+		atomic_store(&sbar->urgent, true);
+	if (!atomic_exchange(&sbar->pending, true)) {
+		atomic_store(&sbar->dirty_since, now_ns());
+		sbar_wake(sbar);
+	} else if (urgent) {
+		sbar_wake(sbar);
+	}
+}
+
+/*
+ * Replace the segment of the status text belonging to component ‘i’ with
+ * ‘text’, moving the segments after it as needed.  Returns whether the
+ * status text changed.
+ */
+static bool sbar_splice(StatusBar *sbar, const uint8_t i, const char *text)
+{
+	Component *c = &sbar->components[i];
+	char *seg = sbar->status + c->seg_off;
+	const size_t text_len = strlen(text);
+	const size_t div_len = (text_len > 0 && i < sbar->ncomponents - 1)
+				       ? sizeof(divider_str) - 1
+				       : 0;
+	const size_t len = text_len + div_len;
+	bool changed;
+
+	if (len != c->seg_len) {
+		memmove(seg + len, seg + c->seg_len,
+			sbar->status_len - c->seg_off - c->seg_len + 1);
+		for (uint8_t j = i + 1; j < sbar->ncomponents; j++)
+			sbar->components[j].seg_off =
+				sbar->components[j].seg_off + len - c->seg_len;
+		sbar->status_len = sbar->status_len + len - c->seg_len;
+		c->seg_len = len;
+		changed = true;
+	} else {
+		changed = memcmp(seg, text, text_len) != 0;
+	}
+	memcpy(seg, text, text_len);
+	memcpy(seg + text_len, divider_str, div_len);
+	return changed;
+}
+
+/*
+ * Render the i3bar block of component ‘i’ with ‘text’, or no block if the
+ * text is empty.  The text is escaped here, once per change, so that a
+ * frame is only a concatenation of blocks.  Returns whether the block
+ * changed.
+ */
+static bool sbar_json_block(StatusBar *sbar, const uint8_t i, const char *text)
+{
+	Component *c = &sbar->components[i];
+	char block[JSON_BLOCK_LEN], id[4];
+	char *const end = block + sizeof(block);
+	char *p = block;
+	size_t len;
+
+	if (*text) {
+		(void)snprintf(id, sizeof(id), "%u", c->id);
+		p = util_cat(p, end, "{\"name\":\"");
+		p = util_json_escape(p, end, c->name ? c->name : "");
+		p = util_cat(p, end, "\",\"instance\":\"");
+		p = util_cat(p, end, id);
+		p = util_cat(p, end, "\",\"full_text\":\"");
+		p = util_json_escape(p, end, text);
+		p = util_cat(p, end, "\"}");
+	}
+	len = (size_t)(p - block);
+	if (len == c->block_len && memcmp(block, c->block, len) == 0)
+		return false;
+	memcpy(c->block, block, len);
+	c->block_len = len;
+	return true;
+}
+
+/*
+ * Splice the text of each component with new text into the status text,
+ * or with -j into its i3bar block.  Returns whether the status changed.
+ */
+static bool sbar_flush(StatusBar *sbar)
+{
+	uint64_t dirty[DIRTY_WORDS];
+	char text[SHOWN_LEN];
+	bool changed = false;
+
+	/* Clear the flags before taking the dirty bits, so that a change
+	   made after this will wake us again */
+	atomic_store(&sbar->pending, false);
+	atomic_store(&sbar->urgent, false);
+	for (size_t w = 0; w < DIRTY_WORDS; w++)
+		dirty[w] = atomic_exchange(&sbar->dirty[w], 0);
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		if (dirty[i / 64] & (UINT64_C(1) << (i % 64))) {
+			sbar_comp_shown(&sbar->components[i], text);
+			if (to_json)
+				changed |= sbar_json_block(sbar, i, text);
+			else
+				changed |= sbar_splice(sbar, i, text);
+		}
+	}
+	if (changed)
+		sbar->last_frame = now_ns();
+	return changed;
+}
+
+static int64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	assert(r == 0);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_add(atomic_uint_fast64_t *v, const uint64_t n)
+{
+	atomic_store_explicit(
+		v, atomic_load_explicit(v, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static unsigned stats_bucket(const uint64_t ns)
+{
+	unsigned b = ns ? 64 - (unsigned)__builtin_clzll(ns) : 0;
+
+	b = b > STATS_MIN_SHIFT ? b - STATS_MIN_SHIFT : 0;
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/*
+ * Account for an update that took ‘wall_ns’, of which ‘cpu_ns’ was spent
+ * on the CPU.
+ */
+static void stats_account(Stats *st, const uint64_t wall_ns,
+			  const uint64_t cpu_ns, const bool error)
+{
+	stats_add(&st->updates, 1);
+	stats_add(&st->wall_ns, wall_ns);
+	stats_add(&st->cpu_ns, cpu_ns);
+	stats_add(&st->hist[stats_bucket(wall_ns)], 1);
+	if (wall_ns < atomic_load_explicit(&st->min_ns, memory_order_relaxed))
+		atomic_store_explicit(&st->min_ns, wall_ns,
+				      memory_order_relaxed);
+	if (wall_ns > atomic_load_explicit(&st->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&st->max_ns, wall_ns,
+				      memory_order_relaxed);
+	if (wall_ns > cpu_ns + STATS_STALL_NS)
+		stats_add(&st->stalls, 1);
+	if (error)
+		stats_add(&st->errors, 1);
+	else
+		atomic_store_explicit(&st->last_ok, now_ns(),
+				      memory_order_relaxed);
+}
+
+/*
+ * Run the component's update function with ‘args’.  The update function is
+ * passed the current text, which it may leave as it is.  Updates of a
+ * component are serialised, but do not block updates of other components
+ * or the flusher.
+ */
+static unsigned sbar_comp_update_with(Component *c, const char *args)
+{
+	char tmpbuf[MAX_COMP_LEN];
+	unsigned long errors;
+	unsigned outcome = 0;
+	int64_t start, cpu;
+
+	if (atomic_load_explicit(&c->sbar->paused, memory_order_relaxed))
+		return UPDATE_SKIPPED;
+
+	int r = pthread_mutex_lock(&c->lock);
+	assert(r == 0);
+
+	/* The instance was torn down on exit */
+	if (c->teardown && !c->state) {
+		r = pthread_mutex_unlock(&c->lock);
+		assert(r == 0);
+		return UPDATE_SKIPPED;
+	}
+
+	trace_update_begin(c->id, args);
+
+	/* Only updates write the text, so we may read it directly */
+	memcpy(tmpbuf, c->buf, sizeof(tmpbuf));
+	errors = util_error_count();
+	start = now_ns();
+	cpu = thread_cpu_ns();
+	c->update(tmpbuf, sizeof(tmpbuf), args, c->state);
+	if (util_error_count() != errors)
+		outcome |= UPDATE_ERROR;
+	stats_account(&c->stats, (uint64_t)(now_ns() - start),
+		      (uint64_t)(thread_cpu_ns() - cpu), outcome & UPDATE_ERROR);
+
+	trace_update_commit();
+	/* Text identical to what is already shown needs neither publishing
+	   nor flushing */
+	if (strcmp(c->buf, tmpbuf) != 0) {
+		sbar_comp_publish(c, tmpbuf);
+		sbar_comp_mark_dirty(c);
+		outcome |= UPDATE_CHANGED;
+	}
+
+	trace_update_end();
+	r = pthread_mutex_unlock(&c->lock);
+	assert(r == 0);
+	return outcome;
+}
+
+static unsigned sbar_comp_update(Component *c)
+{
+	return sbar_comp_update_with(c, c->args);
+}
+
+static void comp_job_run(PoolJob *j)
+{
+	Component *c = (Component *)((char *)j - offsetof(Component, job));
+	char line[STREAM_LINE_LEN];
+	int r;
+
+	if (!c->stream) {
+		atomic_store(&c->last_outcome, sbar_comp_update(c));
+		return;
+	}
+	r = pthread_mutex_lock(&c->stream->job_lock);
+	assert(r == 0);
+	memcpy(line, c->stream->job_line, sizeof(line));
+	r = pthread_mutex_unlock(&c->stream->job_lock);
+	assert(r == 0);
+	atomic_store(&c->last_outcome, sbar_comp_update_with(c, line));
+}
+
+static void comp_job_overdue(PoolJob *j, bool overdue)
+{
+	Component *c = (Component *)((char *)j - offsetof(Component, job));
+
+	trace_change_commit(TRACE_STALE, c->id, overdue);
+	atomic_store(&c->stale, overdue);
+	sbar_comp_mark_dirty(c);
+	trace_update_end();
+}
+
+/*
+ * Update a component with ‘args’: in the calling thread, or if it has a
+ * deadline on the worker pool, so that a blocking update cannot hold up
+ * the caller.  A pooled update has not run yet when this returns, so the
+ * outcome of the previous one is returned instead, or UPDATE_SKIPPED if
+ * that one has not returned either.
+ */
+static unsigned sbar_comp_refresh_with(Component *c, const char *args)
+{
+	size_t len;
+	int r;
+
+	if (!c->deadline_ms || !c->sbar->pooled)
+		return sbar_comp_update_with(c, args);
+	if (c->stream) {
+		/* The args of a stream are never NULL */
+		len = strlen(args);
+		assert(len < sizeof(c->stream->job_line));
+		r = pthread_mutex_lock(&c->stream->job_lock);
+		assert(r == 0);
+		memcpy(c->stream->job_line, args, len + 1);
+		r = pthread_mutex_unlock(&c->stream->job_lock);
+		assert(r == 0);
+	}
+	if (!pool_submit(&c->sbar->pool, &c->job))
+		return UPDATE_SKIPPED;
+	return atomic_load(&c->last_outcome);
+}
+
+static unsigned sbar_comp_refresh(Component *c)
+{
+	return sbar_comp_refresh_with(c, c->args);
+}
+
+/*
+ * Start the worker pool, if any component has a deadline.
+ */
+static void sbar_create_pool(StatusBar *sbar)
+{
+	int r;
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		if (!sbar->components[i].deadline_ms)
+			continue;
+		r = pool_start(&sbar->pool, worker_threads);
+		if (r)
+			fatal(r);
+		sbar->pooled = true;
+		return;
+	}
+}
+
+/*
+ * Adapt the interval of a component to the outcome of a scheduled update,
+ * and return the number of seconds until the next.  Errors double the
+ * interval, up to ‘error_backoff_max’, whether or not it is adaptive.  On
+ * battery every interval is stretched by ‘battery_stretch’.
+ */
+static time_t sched_adapt(Component *c, const unsigned outcome)
+{
+	time_t cur = atomic_load_explicit(&c->cur_interval,
+					  memory_order_relaxed);
+	const time_t max = c->max_interval > error_backoff_max
+				   ? c->max_interval
+				   : error_backoff_max;
+
+	if (outcome & UPDATE_SKIPPED)
+		;
+	else if (outcome & UPDATE_ERROR)
+		cur = cur * 2 < max ? cur * 2 : max;
+	else if (outcome & UPDATE_CHANGED)
+		cur = c->interval;
+	else if (cur * 2 < c->max_interval)
+		cur = cur * 2;
+	else
+		cur = c->max_interval;
+	atomic_store_explicit(&c->cur_interval, cur, memory_order_relaxed);
+	return component_on_battery() ? cur * battery_stretch : cur;
+}
+
+/*
+ * Count a wakeup of one of our threads, e.g. from a timer or a poll.
+ */
+static void sbar_woke(StatusBar *sbar)
+{
+	atomic_fetch_add_explicit(&sbar->wakeups, 1, memory_order_relaxed);
+}
+
+/*
+ * Replace the text of a push component whose last line has expired.
+ */
+static void sbar_comp_expire(Component *c)
+{
+	int r = pthread_mutex_lock(&c->lock);
+	assert(r == 0);
+
+	if (strcmp(c->buf, no_val_str) != 0) {
+		char tmpbuf[MAX_COMP_LEN];
+		memcpy(tmpbuf, no_val_str, sizeof(no_val_str));
+		trace_change_commit(TRACE_EXPIRE, c->id, 0);
+		sbar_comp_publish(c, tmpbuf);
+		sbar_comp_mark_dirty(c);
+		trace_update_end();
+	}
+
+	r = pthread_mutex_unlock(&c->lock);
+	assert(r == 0);
+}
+
+static void sbar_display_drain(void)
+{
+	if (!display_drain()) {
+		log_err("mtstatus: lost connection to display");
+		(void)remove(pidfile);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sbar_output(const char *status)
+{
+	if (to_stdout) {
+		if (puts(status) == EOF) {
+			fatal(errno);
+		}
+		if (fflush(stdout) == EOF) {
+			fatal(errno);
+		}
+	} else {
+		display_set_name(status);
+		sbar_display_drain();
+	}
+}
+
+/*
+ * Output a frame of the i3bar protocol: the array of cached blocks, written
+ * with a single writev().  Frames follow each other as the elements of an
+ * endless array.
+ */
+static void sbar_output_json(StatusBar *sbar)
+{
+	struct iovec iov[2 * UINT8_MAX + 2];
+	const Component *c;
+	unsigned n = 0;
+	bool first = true;
+
+	iov[n++] = (struct iovec){ .iov_base = sbar->json_started ? ",[" : "[",
+				   .iov_len = sbar->json_started ? 2 : 1 };
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		if (!c->block_len)
+			continue;
+		if (!first)
+			iov[n++] = (struct iovec){ .iov_base = ",",
+						   .iov_len = 1 };
+		iov[n++] = (struct iovec){ .iov_base = c->block,
+					   .iov_len = c->block_len };
+		first = false;
+	}
+	iov[n++] = (struct iovec){ .iov_base = "]\n", .iov_len = 2 };
+	if (writev(STDOUT_FILENO, iov, (int)n) < 0)
+		fatal(errno);
+	sbar->json_started = true;
+}
+
+/*
+ * Splice new text into the status, and output it if it changed.
+ */
+static void sbar_flush_output(StatusBar *sbar)
+{
+	bool changed;
+
+	trace_frame_begin();
+	changed = sbar_flush(sbar);
+	trace_frame_end(changed);
+	if (changed && to_json)
+		sbar_output_json(sbar);
+	else if (changed)
+		sbar_output(sbar->status);
+}
+
+/*
+ * Format a duration in ns with a unit suited to its size.
+ */
+static const char *fmt_ns(char *buf, const size_t bufsize, const double ns)
+{
+	if (ns < 1e3)
+		(void)snprintf(buf, bufsize, "%.0fns", ns);
+	else if (ns < 1e6)
+		(void)snprintf(buf, bufsize, "%.1fus", ns / 1e3);
+	else if (ns < 1e9)
+		(void)snprintf(buf, bufsize, "%.1fms", ns / 1e6);
+	else
+		(void)snprintf(buf, bufsize, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+/*
+ * Write the statistics of every component to ‘f’.  ‘blocked’ is the mean
+ * time an update spent off the CPU, e.g. waiting for a command to exit or
+ * for statvfs() on a slow file system; ‘stalls’ counts the updates that
+ * were off the CPU for more than STATS_STALL_NS.
+ */
+static void sbar_stats_dump(StatusBar *sbar, FILE *f)
+{
+	char min[16], mean[16], p99[16], max[16], cpu[16], blocked[16],
+		since[16], ival[16];
+	const int64_t now = now_ns();
+	const uint64_t wakeups = atomic_load(&sbar->wakeups);
+
+	(void)fprintf(f,
+		      "%-3s %-12s %5s %8s %6s %8s %8s %8s %8s %8s %8s %6s "
+		      "%8s\n",
+		      "id", "component", "ival", "updates", "errors", "min",
+		      "mean", "p99", "max", "cpu", "blocked", "stalls",
+		      "last ok");
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		const Component *c = &sbar->components[i];
+		const Stats *st = &c->stats;
+		const uint64_t n = atomic_load(&st->updates);
+		const int64_t last_ok = atomic_load(&st->last_ok);
+		const double wall = (double)atomic_load(&st->wall_ns);
+		const double cpu_ns = (double)atomic_load(&st->cpu_ns);
+		const uint64_t max_ns = atomic_load(&st->max_ns);
+		uint64_t count = 0, total = 0, p99_ns;
+		unsigned b;
+
+		for (b = 0; b < STATS_BUCKETS; b++)
+			total += atomic_load(&st->hist[b]);
+		for (b = 0; b < STATS_BUCKETS - 1; b++) {
+			count += atomic_load(&st->hist[b]);
+			if (count * 100 >= total * 99)
+				break;
+		}
+		/* The upper bound of the bucket the 99th percentile is in */
+		p99_ns = UINT64_C(1) << (STATS_MIN_SHIFT + b);
+		if (p99_ns > max_ns)
+			p99_ns = max_ns;
+		/* The current, adapted interval of periodic components */
+		if (c->interval > 0)
+			(void)snprintf(ival, sizeof(ival), "%llds",
+				       (long long)atomic_load(&c->cur_interval));
+		else
+			(void)snprintf(ival, sizeof(ival), "-");
+		(void)fprintf(
+			f,
+			"%-3u %-12.12s %5s %8" PRIu64 " %6" PRIu64
+			" %8s %8s %8s %8s %8s %8s %6" PRIu64 " %8s\n",
+			c->id, c->name ? c->name : "-", ival, n,
+			atomic_load(&st->errors),
+			n ? fmt_ns(min, sizeof(min),
+				   (double)atomic_load(&st->min_ns))
+			  : "-",
+			n ? fmt_ns(mean, sizeof(mean), wall / (double)n) : "-",
+			n ? fmt_ns(p99, sizeof(p99), (double)p99_ns) : "-",
+			n ? fmt_ns(max, sizeof(max), (double)max_ns) : "-",
+			n ? fmt_ns(cpu, sizeof(cpu), cpu_ns / (double)n) : "-",
+			n ? fmt_ns(blocked, sizeof(blocked),
+				   (wall > cpu_ns ? wall - cpu_ns : 0) /
+					   (double)n)
+			  : "-",
+			atomic_load(&st->stalls),
+			last_ok ? fmt_ns(since, sizeof(since),
+					 (double)(now - last_ok))
+				: "never");
+	}
+	(void)fprintf(f, "%" PRIu64 " wakeups in %s, %.0f per hour%s\n", wakeups,
+		      fmt_ns(since, sizeof(since), (double)(now - sbar->started)),
+		      (double)wakeups * 3.6e12 / (double)(now - sbar->started),
+		      component_on_battery() ? " (on battery)" : "");
+	(void)fflush(f);
+}
+
+/*
+ * Return the first wall-clock multiple of ‘interval’ seconds after ‘now’.
+ * Multiples are counted in local time, so that hourly updates fall on the
+ * hour even in time zones with a fractional-hour offset.
+ */
+static time_t next_boundary(const time_t now, const time_t interval)
+{
+	struct tm tm;
+	long off = localtime_r(&now, &tm) ? tm.tm_gmtoff : 0;
+
+	return ((now + off) / interval + 1) * interval - off;
+}
+
+/*
+ * Create the instance of a stateful component from its args.
+ */
+static void sbar_comp_init_state(Component *c)
+{
+	const ComponentInstance *ci;
+
+	c->state = NULL;
+	c->teardown = NULL;
+	for (size_t k = 0; k < component_ninstances; k++) {
+		ci = &component_instances[k];
+		if (ci->update != c->update)
+			continue;
+		c->state = ci->init(c->args);
+		if (!c->state) {
+			log_errno(errno, "Unable to initialise component %u",
+				  c->id);
+			fatal(errno);
+		}
+		c->teardown = ci->teardown;
+		return;
+	}
+}
+
+/*
+ * Free the instances of stateful components; later updates are skipped.
+ * An instance whose update has yet to return, e.g. one stuck in a call
+ * that may never return, is left for the exit to reclaim.
+ */
+static void sbar_teardown(StatusBar *sbar)
+{
+	Component *c;
+	int r;
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		if (!c->teardown)
+			continue;
+		if (pthread_mutex_trylock(&c->lock) != 0)
+			continue;
+		c->teardown(c->state);
+		c->state = NULL;
+		r = pthread_mutex_unlock(&c->lock);
+		assert(r == 0);
+	}
+}
+
+static void sbar_create(StatusBar *sbar, const uint8_t ncomponents,
+			const ComponentDefn *comp_defns)
+{
+	Component *cp;
+	sigset_t sigset;
+	int r;
+
+	sbar->comp_bufs = calloc(ncomponents * (size_t)MAX_COMP_LEN, 1);
+	if (sbar->comp_bufs == NULL) {
+		fatal(errno);
+	}
+	sbar->ncomponents = ncomponents;
+	sbar->components = calloc(ncomponents, sizeof(Component));
+	if (sbar->components == NULL) {
+		fatal(errno);
+	}
+	sbar->streams = calloc(ncomponents, sizeof(Stream));
+	if (sbar->streams == NULL) {
+		fatal(errno);
+	}
+	sbar->status = calloc(ncomponents, SHOWN_LEN + sizeof(divider_str));
+	if (sbar->status == NULL) {
+		fatal(errno);
+	}
+	sbar->status_len = 0;
+	sbar->blocks = NULL;
+	if (to_json) {
+		sbar->blocks = calloc(ncomponents, JSON_BLOCK_LEN);
+		if (sbar->blocks == NULL)
+			fatal(errno);
+	}
+	sbar->json_started = false;
+	sbar->last_frame = 0;
+	/* Every component's initial text is yet to be shown */
+	for (unsigned w = 0; w < DIRTY_WORDS; w++)
+		atomic_init(&sbar->dirty[w], 0);
+	for (unsigned i = 0; i < ncomponents; i++)
+		sbar->dirty[i / 64] |= UINT64_C(1) << (i % 64);
+	atomic_init(&sbar->pending, true);
+	atomic_init(&sbar->urgent, false);
+	atomic_init(&sbar->dirty_since, now_ns());
+	atomic_init(&sbar->paused, false);
+	atomic_init(&sbar->wakeups, 0);
+	sbar->started = now_ns();
+	sbar->pooled = false;
+	sbar->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sbar->wakefd < 0)
+		fatal(errno);
+
+	/*
+	 * The signal for which each asynchronous component thread will wait
+	 * must be masked in all other threads.  This ensures that the signal
+	 * will never be delivered to any other thread.  We set the mask here
+	 * since all threads inherit their signal mask from their creator.
+	 * The event loop reads the same signals through a signalfd, which
+	 * likewise requires them to be blocked.
+	 */
+	if (sigemptyset(&sigset) < 0) {
+		fatal(errno);
+	}
+
+	/* Create the components */
+	for (unsigned i = 0; i < ncomponents; i++) {
+		cp = &sbar->components[i];
+
+		cp->id = i;
+		cp->buf = sbar->comp_bufs + ((size_t)MAX_COMP_LEN * i);
+		atomic_init(&cp->seq, 0);
+		r = pthread_mutex_init(&cp->lock, NULL);
+		if (r != 0)
+			fatal(r);
+		static_assert(sizeof(no_val_str) <= MAX_COMP_LEN,
+			      "no_val_str too large");
+		memcpy(cp->buf, no_val_str, sizeof(no_val_str));
+		cp->name = comp_defns[i].name;
+		cp->update = comp_defns[i].update;
+		cp->args = comp_defns[i].args;
+		cp->interval = comp_defns[i].interval;
+		cp->max_interval = comp_defns[i].max_interval > cp->interval &&
+						   !(comp_defns[i].flags & COMP_ALIGN)
+					   ? comp_defns[i].max_interval
+					   : cp->interval;
+		atomic_init(&cp->cur_interval, cp->interval);
+		cp->deadline_ms = comp_defns[i].deadline_ms;
+		cp->job = (PoolJob){ .run = comp_job_run,
+				     .overdue = comp_job_overdue,
+				     .budget_ns = cp->deadline_ms *
+						  INT64_C(1000000) };
+		atomic_init(&cp->last_outcome, 0);
+		atomic_init(&cp->stale, false);
+		cp->signum = comp_defns[i].signum;
+		cp->flags = comp_defns[i].flags;
+		cp->watch_fd = -1;
+		cp->stream = NULL;
+		cp->block = sbar->blocks ? sbar->blocks + JSON_BLOCK_LEN * i
+					 : NULL;
+		cp->block_len = 0;
+		memset(&cp->stats, 0, sizeof(cp->stats));
+		atomic_init(&cp->stats.min_ns, UINT64_MAX);
+		if (cp->flags & (COMP_STREAM | COMP_PUSH)) {
+			cp->stream = &sbar->streams[i];
+			cp->stream->cmd = cp->args;
+			cp->stream->push = cp->flags & COMP_PUSH;
+			cp->stream->c = cp;
+			cp->stream->watch.fd = -1;
+			cp->stream->pidfd = -1;
+			cp->stream->backoff = STREAM_MIN_BACKOFF;
+			r = pthread_mutex_init(&cp->stream->job_lock, NULL);
+			if (r != 0)
+				fatal(r);
+			cp->args = "";
+		}
+		if (cp->flags & COMP_PUSH) {
+			/* The interval is the time to live of a pushed line,
+			   and the component has no timer of its own */
+			cp->stream->ttl = cp->interval > 0 ? cp->interval : 0;
+			cp->interval = cp->max_interval = -1;
+		}
+		if (cp->signum >= 0) {
+			/* We assume ‘signum’ specifies an offset into the
+			   real-time signal numbers and adjust it
+			   accordingly. */
+			cp->signum += SIGRTMIN;
+			if (sigaddset(&sigset, cp->signum) < 0) {
+				fatal(errno);
+			}
+		}
+		sbar_comp_init_state(cp);
+		cp->sbar = sbar;
+	}
+	r = pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	assert(!r);
+	sbar->sigset = sigset;
+}
+
+/*
+ * Open a push component's FIFO, creating it if need be.
+ */
+static int stream_open_fifo(Stream *s)
+{
+	struct stat st;
+	int fd;
+
+	if (mkfifo(s->cmd, 0600) < 0 && errno != EEXIST) {
+		log_errno(errno, "Error: unable to create FIFO '%s'", s->cmd);
+		return -1;
+	}
+	fd = open(s->cmd, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(errno, "Error: unable to open FIFO '%s'", s->cmd);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+		log_err("Error: '%s' is not a FIFO", s->cmd);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Start a stream's producer, or open its FIFO, returning whether it was
+ * started.
+ */
+static bool stream_start(Stream *s)
+{
+	char *const argv[] = { "/bin/sh", "-c", (char *)s->cmd, NULL };
+
+	s->len = 0;
+	s->overflow = false;
+	s->started = time(NULL);
+	if (s->push)
+		s->watch.fd = stream_open_fifo(s);
+	else
+		s->watch.fd = util_spawn(argv, &s->pidfd);
+	return s->watch.fd >= 0;
+}
+
+/*
+ * Stop a stream's producer and return the delay, in seconds, before it
+ * should be restarted.
+ */
+static unsigned stream_backoff(Stream *s)
+{
+	unsigned delay = s->backoff;
+
+	if (s->backoff < STREAM_MAX_BACKOFF)
+		s->backoff *= 2;
+	return delay;
+}
+
+static unsigned stream_stop(Stream *s)
+{
+	close(s->watch.fd);
+	s->watch.fd = -1;
+	if (s->pidfd >= 0)
+		util_reap(s->pidfd);
+	s->pidfd = -1;
+
+	/* Back off only if the producer did not stay up for long */
+	if (time(NULL) - s->started >= STREAM_MAX_BACKOFF)
+		s->backoff = STREAM_MIN_BACKOFF;
+	log_err("Stream '%s' exited; restarting in %us", s->cmd, s->backoff);
+	return stream_backoff(s);
+}
+
+/*
+ * Read what the producer has printed and update the component with the
+ * last complete line.  Lines too long for the buffer are discarded.
+ * Returns false once the producer has closed its output.
+ */
+static bool stream_read(Stream *s)
+{
+	char *nl, *last = NULL;
+	size_t consumed = 0;
+	ssize_t n;
+
+	while (true) {
+		n = read(s->watch.fd, s->line + s->len,
+			 sizeof(s->line) - 1 - s->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		s->len += (size_t)n;
+
+		while ((nl = memchr(s->line + consumed, '\n',
+				    s->len - consumed))) {
+			*nl = '\0';
+			if (!s->overflow)
+				last = s->line + consumed;
+			s->overflow = false;
+			consumed = (size_t)(nl - s->line) + 1;
+		}
+		if (consumed == 0 && s->len == sizeof(s->line) - 1) {
+			s->overflow = true;
+			s->len = 0;
+		}
+		if (last) {
+			sbar_comp_refresh_with(s->c, last);
+			if (s->ttl)
+				s->expires = now_ns() +
+					     s->ttl * INT64_C(1000000000);
+			last = NULL;
+		}
+		memmove(s->line, s->line + consumed, s->len - consumed);
+		s->len -= consumed;
+		consumed = 0;
+	}
+	return n < 0 && errno == EAGAIN;
+}
+
+static int sbar_try_watch(StatusBar *sbar, Watch *w);
+
+static void sbar_watch(StatusBar *sbar, Watch *w)
+{
+	const int r = sbar_try_watch(sbar, w);
+
+	if (r)
+		fatal(r);
+}
+
+static void notifier_handle(StatusBar *sbar, Watch *w)
+{
+	const Notifier *n = (Notifier *)w;
+
+	if (!n->drain(w->fd))
+		return;
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		if (sbar->components[i].watch_fd == w->fd)
+			sbar_comp_refresh(&sbar->components[i]);
+	}
+}
+
+static void display_handle(StatusBar *sbar, Watch *w)
+{
+	sbar_display_drain();
+}
+
+/*
+ * Watch the connection to the X server, so that the events which keep the
+ * keyboard state current, and the errors of requests sent without waiting
+ * for a reply, are consumed as they arrive.
+ */
+static void sbar_create_display_watch(StatusBar *sbar)
+{
+	if (to_stdout)
+		return;
+	sbar->display.handle = display_handle;
+	sbar->display.fd = display_fd();
+	sbar_watch(sbar, &sbar->display);
+}
+
+/*
+ * Refresh the component that an i3bar click event (one line of JSON) was
+ * on.  Blocks are identified by the component's index as their instance.
+ * The events after the first are preceded by a comma, and the first by
+ * the ‘[’ that opens the endless array of them.
+ */
+static void sbar_click(StatusBar *sbar, const char *event)
+{
+	char instance[16];
+	unsigned long i;
+	char *end;
+
+	while (*event == '[' || *event == ',' || *event == ' ')
+		event++;
+	if (!util_json_get(event, "instance", instance, sizeof(instance)))
+		return;
+	i = strtoul(instance, &end, 10);
+	if (end == instance || *end || i >= sbar->ncomponents)
+		return;
+	sbar_comp_refresh(&sbar->components[i]);
+}
+
+static void clicks_handle(StatusBar *sbar, Watch *w)
+{
+	char *line, *nl;
+	ssize_t n;
+
+	n = read(w->fd, sbar->click_buf + sbar->click_len,
+		 sizeof(sbar->click_buf) - 1 - sbar->click_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		/* Stop watching; closing removes it from the epoll set */
+		if (n < 0)
+			log_errno(errno, "Unable to read click events");
+		close(w->fd);
+		w->fd = -1;
+		return;
+	}
+	sbar->click_len += (size_t)n;
+	sbar->click_buf[sbar->click_len] = '\0';
+
+	line = sbar->click_buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		sbar_click(sbar, line);
+		line = nl + 1;
+	}
+	sbar->click_len -= (size_t)(line - sbar->click_buf);
+	/* Discard a line too long to be a click event */
+	if (sbar->click_len == sizeof(sbar->click_buf) - 1)
+		sbar->click_len = 0;
+	memmove(sbar->click_buf, line, sbar->click_len);
+}
+
+/*
+ * With -j, read the click events that i3bar writes to stdin.
+ */
+static void sbar_create_clicks_watch(StatusBar *sbar)
+{
+	int flags, r;
+
+	if (!to_json)
+		return;
+	sbar->click_len = 0;
+	sbar->clicks.handle = clicks_handle;
+	sbar->clicks.fd = STDIN_FILENO;
+	flags = fcntl(STDIN_FILENO, F_GETFL);
+	if (flags < 0 ||
+	    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) < 0) {
+		log_errno(errno, "Unable to read click events");
+		return;
+	}
+	/* epoll refuses stdin when it is /dev/null or a regular file, as
+	   when the bar is not run by i3bar; there are no clicks to read */
+	r = sbar_try_watch(sbar, &sbar->clicks);
+	if (r == EPERM)
+		log_err("Not reading click events: stdin cannot be watched");
+	else if (r)
+		fatal(r);
+}
+
+/*
+ * Open the change notification descriptor of each component that has one
+ * and start watching it.  Components whose source hands out the same
+ * descriptor share a single notifier.
+ */
+static void sbar_create_notifiers(StatusBar *sbar)
+{
+	const ComponentWatch *cw;
+	Component *c;
+	Notifier *n;
+	unsigned j;
+	int fd;
+
+	sbar->notifiers = calloc(sbar->ncomponents, sizeof(Notifier));
+	if (sbar->notifiers == NULL)
+		fatal(errno);
+	sbar->nnotifiers = 0;
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		cw = NULL;
+		for (size_t k = 0; k < component_nwatches && !cw; k++) {
+			if (component_watches[k].update == c->update)
+				cw = &component_watches[k];
+		}
+		if (!cw)
+			continue;
+
+		fd = cw->open(c->args);
+		if (fd < 0) {
+			log_errno(errno, "Unable to watch component %u", c->id);
+			continue;
+		}
+		c->watch_fd = fd;
+		for (j = 0; j < sbar->nnotifiers; j++) {
+			if (sbar->notifiers[j].watch.fd == fd)
+				break;
+		}
+		if (j < sbar->nnotifiers)
+			continue;
+
+		n = &sbar->notifiers[sbar->nnotifiers++];
+		n->watch.fd = fd;
+		n->watch.handle = notifier_handle;
+		n->drain = cw->drain;
+		sbar_watch(sbar, &n->watch);
+	}
+}
+
+/*
+ * Find the component named ‘arg’, or else the one with the index ‘arg’.
+ */
+static Component *sbar_find(StatusBar *sbar, const char *arg)
+{
+	unsigned long i;
+	char *end;
+
+	for (uint8_t k = 0; k < sbar->ncomponents; k++) {
+		if (sbar->components[k].name &&
+		    strcmp(sbar->components[k].name, arg) == 0)
+			return &sbar->components[k];
+	}
+	i = strtoul(arg, &end, 10);
+	if (end == arg || *end || i >= sbar->ncomponents)
+		return NULL;
+	return &sbar->components[i];
+}
+
+static void sbar_update_all(StatusBar *sbar)
+{
+	for (uint8_t i = 0; i < sbar->ncomponents; i++)
+		sbar_comp_refresh(&sbar->components[i]);
+}
+
+/*
+ * Write the text of every component to ‘buf’ as it is shown in the status.
+ * Unlike the status text itself this may be read from any thread.
+ */
+static char *sbar_get_status(StatusBar *sbar, char *buf, const char *end)
+{
+	char text[SHOWN_LEN];
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		sbar_comp_shown(&sbar->components[i], text);
+		buf = util_cat(buf, end, text);
+		if (*text && i < sbar->ncomponents - 1)
+			buf = util_cat(buf, end, divider_str);
+	}
+	return buf;
+}
+
+/*
+ * Run the control command ‘req’ (see ctl.h), which is modified, and write
+ * the reply to ‘reply’.  Returns the length of the reply.
+ */
+static size_t ctl_exec(StatusBar *sbar, char *req, char *reply,
+		       const size_t size)
+{
+	char *const end = reply + size - 1;
+	char *cmd, *arg, *save, *p = reply;
+	const char *err = NULL;
+	Component *c = NULL;
+	FILE *f;
+
+	cmd = strtok_r(req, " \t\n", &save);
+	arg = cmd ? strtok_r(NULL, " \t\n", &save) : NULL;
+	if (!cmd || (arg && strtok_r(NULL, " \t\n", &save))) {
+		err = "expected a command and at most one component";
+	} else if (arg && !(c = sbar_find(sbar, arg))) {
+		err = "no such component";
+	} else if (strcmp(cmd, "refresh") == 0) {
+		if (atomic_load(&sbar->paused))
+			err = "paused";
+		else if (c)
+			sbar_comp_refresh(c);
+		else
+			sbar_update_all(sbar);
+	} else if (strcmp(cmd, "get") == 0) {
+		p = util_cat(p, end, CTL_OK);
+		if (c) {
+			char text[SHOWN_LEN];
+			sbar_comp_shown(c, text);
+			p = util_cat(p, end, text);
+		} else {
+			p = sbar_get_status(sbar, p, end);
+		}
+		p = util_cat(p, end, "\n");
+	} else if (arg) {
+		err = "unexpected component";
+	} else if (strcmp(cmd, "pause") == 0) {
+		atomic_store(&sbar->paused, true);
+	} else if (strcmp(cmd, "resume") == 0) {
+		atomic_store(&sbar->paused, false);
+		sbar_update_all(sbar);
+	} else if (strcmp(cmd, "stats") == 0) {
+		f = fmemopen(reply, size, "w");
+		if (!f) {
+			err = strerror(errno);
+		} else {
+			(void)fputs(CTL_OK, f);
+			sbar_stats_dump(sbar, f);
+			p = reply + ftell(f);
+			(void)fclose(f);
+		}
+	} else {
+		err = "unknown command";
+	}
+
+	if (err) {
+		p = util_cat(reply, end, CTL_ERROR);
+		p = util_cat(p, end, err);
+		p = util_cat(p, end, "\n");
+	} else if (p == reply) {
+		p = util_cat(p, end, CTL_OK);
+	}
+	return (size_t)(p - reply);
+}
+
+/*
+ * Serve one message from a control client.  Returns false once the client
+ * has gone.
+ */
+static bool ctl_serve(StatusBar *sbar, int fd)
+{
+	char req[CTL_MAX_MSG], reply[CTL_MAX_MSG];
+	ssize_t n;
+	size_t len;
+
+	do {
+		n = recv(fd, req, sizeof(req) - 1, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0 && errno == EAGAIN)
+		return true;
+	if (n <= 0)
+		return false;
+	req[n] = '\0';
+	len = ctl_exec(sbar, req, reply, sizeof(reply));
+	return send(fd, reply, len, MSG_NOSIGNAL) >= 0;
+}
+
+#ifdef THREADED
+/*
+ * Serve a control client from a thread of its own, until it disconnects.
+ */
+static void *thread_ctl_client(void *arg)
+{
+	Watch *w = (Watch *)arg;
+
+	while (ctl_serve(w->sbar, w->fd))
+		sbar_woke(w->sbar);
+	close(w->fd);
+	free(w);
+	return NULL;
+}
+#else
+static void ctl_client_handle(StatusBar *sbar, Watch *w)
+{
+	/* Closing the descriptor removes it from the epoll set */
+	if (!ctl_serve(sbar, w->fd)) {
+		close(w->fd);
+		free(w);
+	}
+}
+#endif
+
+static void ctl_accept_handle(StatusBar *sbar, Watch *w)
+{
+	Watch *client;
+	int fd;
+
+#ifdef THREADED
+	fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+	/* The loop must not block on a client that sends nothing */
+	fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			log_errno(errno, "Unable to accept control client");
+		return;
+	}
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		fatal(errno);
+	client->fd = fd;
+#ifdef THREADED
+	pthread_t tid;
+	int r;
+
+	client->sbar = sbar;
+	r = pthread_create(&tid, NULL, thread_ctl_client, client);
+	if (r)
+		fatal(r);
+	r = pthread_detach(tid);
+	if (r)
+		fatal(r);
+#else
+	client->handle = ctl_client_handle;
+	sbar_watch(sbar, client);
+#endif
+}
+
+/*
+ * Listen on the control socket.  If another instance is already listening
+ * on it, this one runs without one.
+ */
+static void sbar_create_ctl(StatusBar *sbar)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!ctl_addr(&addr)) {
+		log_errno(errno, "Unable to create control socket");
+		return;
+	}
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		fatal(errno);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		log_err("Control socket %s is in use", addr.sun_path);
+		close(fd);
+		return;
+	}
+	/* Nothing is listening, so any socket there is stale */
+	(void)unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 8) < 0) {
+		log_errno(errno, "Unable to create control socket %s",
+			  addr.sun_path);
+		close(fd);
+		return;
+	}
+	memcpy(ctl_sock, addr.sun_path, sizeof(ctl_sock));
+	sbar->ctl.fd = fd;
+	sbar->ctl.handle = ctl_accept_handle;
+	sbar_watch(sbar, &sbar->ctl);
+}
+
+#ifdef THREADED
+static void *thread_flush(void *arg)
+{
+	StatusBar *sbar = (StatusBar *)arg;
+
+	struct pollfd pfd = { .fd = sbar->wakefd, .events = POLLIN };
+	uint64_t n;
+	int64_t wait;
+	int timeout;
+
+	while (true) {
+		timeout = -1;
+		if (atomic_load(&sbar->pending)) {
+			wait = sbar_frame_due(sbar) - now_ns();
+			if (wait <= 0) {
+				sbar_flush_output(sbar);
+				continue;
+			}
+			timeout = (int)((wait + 999999) / 1000000);
+		}
+		/* Sleep until woken, or until the pending frame is due */
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			fatal(errno);
+		sbar_woke(sbar);
+		if (read(sbar->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			fatal(errno);
+	}
+
+	return NULL;
+}
+
+static void *thread_repeating(void *arg)
+{
+	Component *c = (Component *)arg;
+	const bool align = c->flags & COMP_ALIGN;
+	const clockid_t clk = align ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+	struct timespec deadline;
+	time_t next = c->interval;
+	unsigned outcome;
+	int r;
+
+	/*
+	 * Sleep until absolute deadlines so that the time taken by each
+	 * update does not accumulate as drift.
+	 */
+	r = clock_gettime(clk, &deadline);
+	assert(r == 0);
+	while (true) {
+		if (align) {
+			r = clock_gettime(clk, &deadline);
+			assert(r == 0);
+			deadline.tv_sec = next_boundary(deadline.tv_sec,
+							c->interval);
+			deadline.tv_nsec = 0;
+		} else {
+			deadline.tv_sec += next;
+		}
+		do {
+			r = clock_nanosleep(clk, TIMER_ABSTIME, &deadline,
+					    NULL);
+		} while (r == EINTR);
+		assert(r == 0);
+		sbar_woke(c->sbar);
+		outcome = sbar_comp_refresh(c);
+		if (!align)
+			next = sched_adapt(c, outcome);
+	}
+	return NULL;
+}
+
+static void *thread_async(void *arg)
+{
+	Component *c = (Component *)arg;
+	sigset_t sigset;
+	int sig, r;
+
+	if (sigemptyset(&sigset) < 0) {
+		fatal(errno);
+	}
+	if (sigaddset(&sigset, c->signum) < 0) {
+		fatal(errno);
+	}
+
+	while (true) {
+		r = sigwait(&sigset, &sig);
+		if (r == -1) {
+			fatal(r);
+		}
+		sbar_woke(c->sbar);
+		assert(sig == c->signum && "unexpected signal received");
+		sbar_comp_refresh(c);
+	}
+
+	return NULL;
+}
+
+static void *thread_watch(void *arg)
+{
+	Watch *w = (Watch *)arg;
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+	/* A handler stops the watch by closing it and setting ‘fd’ to -1 */
+	while (w->fd >= 0) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal(errno);
+		}
+		sbar_woke(w->sbar);
+		w->handle(w->sbar, w);
+	}
+
+	return NULL;
+}
+
+static int sbar_try_watch(StatusBar *sbar, Watch *w)
+{
+	int r;
+
+	w->sbar = sbar;
+	r = pthread_create(&w->thread, NULL, thread_watch, w);
+	if (r)
+		return r;
+	return pthread_detach(w->thread);
+}
+
+/*
+ * Return the poll() timeout until a stream's pushed line expires.
+ */
+static int stream_timeout(Stream *s)
+{
+	int64_t wait;
+
+	if (!s->expires)
+		return -1;
+	wait = s->expires - now_ns();
+	return wait > 0 ? (int)((wait + 999999) / 1000000) : 0;
+}
+
+static void *thread_stream(void *arg)
+{
+	Stream *s = (Stream *)arg;
+	struct pollfd pfd = { .events = POLLIN };
+	unsigned delay;
+	int n;
+
+	while (true) {
+		if (stream_start(s)) {
+			pfd.fd = s->watch.fd;
+			while ((n = poll(&pfd, 1, stream_timeout(s))) >= 0 ||
+			       errno == EINTR) {
+				sbar_woke(s->c->sbar);
+				if (n == 0) {
+					s->expires = 0;
+					sbar_comp_expire(s->c);
+					continue;
+				}
+				if (n > 0 && !stream_read(s))
+					break;
+			}
+			delay = stream_stop(s);
+		} else {
+			delay = stream_backoff(s);
+		}
+		sleep(delay);
+	}
+
+	return NULL;
+}
+
+static void *thread_once(void *arg)
+{
+	Component *c = (Component *)arg;
+	sbar_comp_refresh(c);
+	return NULL;
+}
+
+static void sbar_start(StatusBar *sbar)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	Component *c;
+	int r;
+
+	r = pthread_attr_init(&attr);
+	if (r)
+		fatal(r);
+	r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (r)
+		fatal(r);
+	r = pthread_create(&sbar->thread, &attr, thread_flush, sbar);
+	if (r)
+		fatal(r);
+	sbar_create_pool(sbar);
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		r = pthread_create(&tid, &attr, thread_once, c);
+		if (r)
+			fatal(r);
+		if (c->interval >= 0) {
+			r = pthread_create(&c->thr_repeating, &attr,
+					   thread_repeating, c);
+			if (r)
+				fatal(r);
+		}
+		if (c->signum >= 0) {
+			r = pthread_create(&c->thr_async, &attr, thread_async,
+					   c);
+			if (r)
+				fatal(r);
+		}
+		if (c->stream) {
+			r = pthread_create(&c->stream->thread, &attr,
+					   thread_stream, c->stream);
+			if (r)
+				fatal(r);
+		}
+	}
+}
+
+/*
+ * Run the status bar until one of the signals in ‘termset’ is received, and
+ * return that signal.
+ */
+static int sbar_run(StatusBar *sbar, const sigset_t *termset)
+{
+	int sig, r;
 
-#include "config.h"
+	sbar_start(sbar);
+	sbar_create_display_watch(sbar);
+	sbar_create_notifiers(sbar);
+	sbar_create_ctl(sbar);
+	sbar_create_clicks_watch(sbar);
+	do {
+		r = sigwait(termset, &sig);
+		if (r != 0)
+			fatal(r);
+		if (sig == SIGUSR1)
+			sbar_stats_dump(sbar, stderr);
+	} while (sig == SIGUSR1);
+	return sig;
+}
+#else
+static int sbar_try_watch(StatusBar *sbar, Watch *w)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
 
-Display *dpy = NULL;
+	if (epoll_ctl(sbar->epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+		return errno;
+	return 0;
+}
 
-static char pidfile[MAX_COMP_LEN];
-static bool to_stdout = false;
+/*
+ * Arm a timer.  Periodic timerfds expire on absolute deadlines, so the time
+ * taken by updates does not accumulate as drift.  Aligned timers are
+ * additionally set against the real-time clock at a wall-clock boundary,
+ * and are cancelled if the clock is set so that they can be re-aligned.
+ */
+static void timer_arm(Timer *t)
+{
+	struct itimerspec its = { .it_interval = { .tv_sec = t->interval } };
+	int flags = 0;
 
-static void fatal(int code)
+	if (t->align) {
+		its.it_value.tv_sec = next_boundary(time(NULL), t->interval);
+		flags = TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET;
+	} else {
+		its.it_value.tv_sec = t->interval;
+	}
+	if (timerfd_settime(t->watch.fd, flags, &its, NULL) < 0)
+		fatal(errno);
+}
+
+static void timer_handle(StatusBar *sbar, Watch *w)
 {
-	log_err("mtstatus: fatal: %s", strerror(code));
-	if (!to_stdout && remove(pidfile) < 0) {
-		log_err("Unable to remove %s", pidfile);
+	Timer *t = (Timer *)w;
+	Component *c;
+	uint64_t expirations;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
+		if (errno != ECANCELED)
+			fatal(errno);
+		/* The clock was set: refresh now and re-align */
+		timer_arm(t);
+	}
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		if (c->interval == t->interval &&
+		    (bool)(c->flags & COMP_ALIGN) == t->align)
+			sbar_comp_refresh(c);
 	}
-	exit(EXIT_FAILURE);
 }
 
-static void sbar_flush_on_dirty(StatusBar *sbar, char *buf,
-				const size_t bufsize)
+static void signal_handle(StatusBar *sbar, Watch *w)
 {
-	int i = 0;
-	char *ptr = buf;
-	char *end = buf + bufsize;
-	const char *cbuf;
-	int r;
+	struct signalfd_siginfo si;
+	int sig;
 
-	/*
-	 * Maintain the status bar "dirty" invariant.
-	 */
-	r = pthread_mutex_lock(&sbar->mutex);
-	assert(r == 0);
-	while (!sbar->dirty) {
-		r = pthread_cond_wait(&sbar->dirty_cond, &sbar->mutex);
-		assert(r == 0);
+	if (read(w->fd, &si, sizeof(si)) < 0) {
+		if (errno == EAGAIN)
+			return;
+		fatal(errno);
 	}
-	for (i = 0; (ptr < end) && (i < sbar->ncomponents - 1); i++) {
-		cbuf = sbar->components[i].buf;
-		if (strlen(cbuf) > 0) {
-			ptr = util_cat(ptr, end, cbuf);
-			ptr = util_cat(ptr, end, divider_str);
-		}
+	sig = (int)si.ssi_signo;
+	if (sig == SIGUSR1) {
+		sbar_stats_dump(sbar, stderr);
+		return;
 	}
-	if (ptr < end) {
-		cbuf = sbar->components[i].buf;
-		if (strlen(cbuf) > 0) {
-			ptr = util_cat(ptr, end, cbuf);
-		}
+	if (sigismember(&sbar->sigset, sig) != 1) {
+		sbar->quit_sig = sig;
+		return;
 	}
-	*ptr = 0;
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		if (sbar->components[i].signum == sig)
+			sbar_comp_refresh(&sbar->components[i]);
+	}
+}
 
-	sbar->dirty = false;
-	r = pthread_mutex_unlock(&sbar->mutex);
-	assert(r == 0);
+/*
+ * Arm the scheduler's timer for the earliest scheduled update.
+ */
+static void sched_arm(StatusBar *sbar)
+{
+	struct itimerspec its = { 0 };
+	int64_t due = 0;
+	const Component *c;
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		if (c->due && (!due || c->due < due))
+			due = c->due;
+	}
+	its.it_value.tv_sec = due / 1000000000;
+	its.it_value.tv_nsec = due % 1000000000;
+	if (timerfd_settime(sbar->sched.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fatal(errno);
 }
 
-static void sbar_comp_update(const Component *c)
+/*
+ * Run the scheduled updates that are due, along with those due within
+ * SCHED_SLACK_NS, so that components whose deadlines nearly coincide share
+ * one wakeup.  Each is then rescheduled after its adapted interval.
+ */
+static void sched_handle(StatusBar *sbar, Watch *w)
 {
-	char tmpbuf[MAX_COMP_LEN];
+	uint64_t expirations;
+	int64_t now, next;
+	Component *c;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
+		fatal(errno);
+	}
+	now = now_ns();
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		if (!c->due || c->due > now + SCHED_SLACK_NS)
+			continue;
+		next = sched_adapt(c, sbar_comp_refresh(c)) *
+		       INT64_C(1000000000);
+		/* Keep to deadlines, so that the time taken by updates does
+		   not accumulate as drift, unless we have fallen behind */
+		c->due += next;
+		if (c->due <= now)
+			c->due = now + next;
+	}
+	sched_arm(sbar);
+}
 
-	c->update(tmpbuf, sizeof(tmpbuf), c->args);
+/*
+ * Schedule the periodic components that are not aligned.  They are
+ * updated from a single timerfd, so that their intervals can adapt.
+ */
+static void sbar_create_sched(StatusBar *sbar)
+{
+	const int64_t now = now_ns();
+	Component *c;
 
-	/*
-	 * Maintain the status bar "dirty" invariant.
-	 */
-	int r = pthread_mutex_lock(&c->sbar->mutex);
-	assert(r == 0);
-	static_assert(MAX_COMP_LEN >= sizeof(tmpbuf),
-		      "size of component buffer < sizeof(tmpbuf)");
-	memcpy(c->buf, tmpbuf, sizeof(tmpbuf));
-	c->sbar->dirty = true;
-	r = pthread_cond_signal(&c->sbar->dirty_cond);
-	assert(r == 0);
-	r = pthread_mutex_unlock(&c->sbar->mutex);
-	assert(r == 0);
+	sbar->sched.handle = sched_handle;
+	sbar->sched.fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sbar->sched.fd < 0)
+		fatal(errno);
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		c = &sbar->components[i];
+		c->due = 0;
+		if (c->interval > 0 && !(c->flags & COMP_ALIGN))
+			c->due = now + c->interval * INT64_C(1000000000);
+	}
+	sched_arm(sbar);
+	sbar_watch(sbar, &sbar->sched);
 }
 
-static void *thread_flush(void *arg)
+/*
+ * Create one timerfd for each distinct interval of the aligned components.
+ * Components sharing a timer are updated together when it expires.
+ */
+static void sbar_create_timers(StatusBar *sbar)
 {
-	StatusBar *sbar = (StatusBar *)arg;
-	char status[N_COMPONENTS * MAX_COMP_LEN];
+	Timer *t;
+	time_t interval;
+	bool align;
+	unsigned j;
 
-	while (true) {
-		sbar_flush_on_dirty(sbar, status, LEN(status));
+	sbar->timers = calloc(sbar->ncomponents, sizeof(Timer));
+	if (sbar->timers == NULL)
+		fatal(errno);
+	sbar->ntimers = 0;
 
-		if (to_stdout) {
-			if (puts(status) == EOF) {
-				fatal(errno);
-			}
-			if (fflush(stdout) == EOF) {
-				fatal(errno);
-			}
-		} else {
-			XStoreName(dpy, DefaultRootWindow(dpy), status);
-			XFlush(dpy);
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		interval = sbar->components[i].interval;
+		align = sbar->components[i].flags & COMP_ALIGN;
+		if (interval <= 0 || !align)
+			continue;
+		for (j = 0; j < sbar->ntimers; j++) {
+			if (sbar->timers[j].interval == interval &&
+			    sbar->timers[j].align == align)
+				break;
 		}
+		if (j < sbar->ntimers)
+			continue;
+
+		t = &sbar->timers[sbar->ntimers++];
+		t->interval = interval;
+		t->align = align;
+		t->watch.handle = timer_handle;
+		t->watch.fd = timerfd_create(align ? CLOCK_REALTIME
+						   : CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+		if (t->watch.fd < 0)
+			fatal(errno);
+		timer_arm(t);
+		sbar_watch(sbar, &t->watch);
 	}
+}
 
-	return NULL;
+static void stream_schedule(Stream *s, const unsigned delay)
+{
+	struct itimerspec its = { .it_value = { .tv_sec = delay } };
+
+	if (timerfd_settime(s->restart.fd, 0, &its, NULL) < 0)
+		fatal(errno);
 }
 
-static void *thread_repeating(void *arg)
+static void stream_handle(StatusBar *sbar, Watch *w)
 {
-	const Component *c = (Component *)arg;
+	Stream *s = (Stream *)w;
+	const int64_t expires = s->expires;
+	struct itimerspec its = { 0 };
 
-	while (true) {
-		sleep((unsigned)c->interval);
-		sbar_comp_update(c);
+	/* Closing the descriptor removes it from the epoll set */
+	if (!stream_read(s)) {
+		stream_schedule(s, stream_stop(s));
+		return;
+	}
+	if (s->expires != expires) {
+		its.it_value.tv_sec = s->expires / 1000000000;
+		its.it_value.tv_nsec = s->expires % 1000000000;
+		if (timerfd_settime(s->expire.fd, TFD_TIMER_ABSTIME, &its,
+				    NULL) < 0)
+			fatal(errno);
 	}
-	return NULL;
 }
 
-static void *thread_async(void *arg)
+static void stream_expire_handle(StatusBar *sbar, Watch *w)
 {
-	Component *c = (Component *)arg;
-	sigset_t sigset;
-	int sig, r;
+	Stream *s = (Stream *)((char *)w - offsetof(Stream, expire));
+	uint64_t expirations;
 
-	if (sigemptyset(&sigset) < 0) {
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
 		fatal(errno);
 	}
-	if (sigaddset(&sigset, c->signum) < 0) {
+	s->expires = 0;
+	sbar_comp_expire(s->c);
+}
+
+static void stream_restart_handle(StatusBar *sbar, Watch *w)
+{
+	Stream *s = (Stream *)((char *)w - offsetof(Stream, restart));
+	uint64_t expirations;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
 		fatal(errno);
 	}
+	if (stream_start(s))
+		sbar_watch(sbar, &s->watch);
+	else
+		stream_schedule(s, stream_backoff(s));
+}
 
-	while (true) {
-		r = sigwait(&sigset, &sig);
-		if (r == -1) {
-			fatal(r);
-		}
-		assert(sig == c->signum && "unexpected signal received");
-		sbar_comp_update(c);
-	}
+/*
+ * Arm the frame timer to wake the event loop when pending changes are due.
+ */
+static void frame_timer_arm(StatusBar *sbar, const int64_t due)
+{
+	struct itimerspec its = {
+		.it_value = { .tv_sec = due / 1000000000,
+			      .tv_nsec = due % 1000000000 },
+	};
 
-	return NULL;
+	if (timerfd_settime(sbar->frame_timer.fd, TFD_TIMER_ABSTIME, &its,
+			    NULL) < 0)
+		fatal(errno);
 }
 
-static void *thread_once(void *arg)
+static void wake_handle(StatusBar *sbar, Watch *w)
 {
-	const Component *c = (Component *)arg;
-	sbar_comp_update(c);
-	return NULL;
+	uint64_t n;
+
+	if (read(w->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		fatal(errno);
 }
 
-static void sbar_create(StatusBar *sbar, const uint8_t ncomponents,
-			const ComponentDefn *comp_defns)
+static void frame_timer_handle(StatusBar *sbar, Watch *w)
 {
-	Component *cp;
-	sigset_t sigset;
-	int r;
+	uint64_t expirations;
 
-	sbar->comp_bufs = calloc(ncomponents * (size_t)MAX_COMP_LEN, 1);
-	if (sbar->comp_bufs == NULL) {
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
 		fatal(errno);
+}
+
+static void sbar_create_streams(StatusBar *sbar)
+{
+	Stream *s;
+
+	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
+		s = sbar->components[i].stream;
+		if (!s)
+			continue;
+		s->watch.handle = stream_handle;
+		s->restart.handle = stream_restart_handle;
+		s->restart.fd = timerfd_create(CLOCK_MONOTONIC,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->restart.fd < 0)
+			fatal(errno);
+		sbar_watch(sbar, &s->restart);
+		if (s->ttl) {
+			s->expire.handle = stream_expire_handle;
+			s->expire.fd = timerfd_create(
+				CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (s->expire.fd < 0)
+				fatal(errno);
+			sbar_watch(sbar, &s->expire);
+		}
+		if (stream_start(s))
+			sbar_watch(sbar, &s->watch);
+		else
+			stream_schedule(s, stream_backoff(s));
 	}
-	sbar->ncomponents = ncomponents;
-	sbar->components = calloc(ncomponents, sizeof(Component));
-	if (sbar->components == NULL) {
-		fatal(errno);
+}
+
+/*
+ * Run the status bar until one of the signals in ‘termset’ is received, and
+ * return that signal.  Every component is driven from a single epoll set
+ * in the calling thread, so the number of threads does not depend on the
+ * number of components.
+ */
+static int sbar_run(StatusBar *sbar, const sigset_t *termset)
+{
+	struct epoll_event events[16];
+	sigset_t sigset = sbar->sigset;
+	int64_t due;
+	int n;
+
+	for (int sig = 1; sig < NSIG; sig++) {
+		if (sigismember(termset, sig) == 1 &&
+		    sigaddset(&sigset, sig) < 0)
+			fatal(errno);
 	}
-	sbar->dirty = false;
-	r = pthread_mutex_init(&sbar->mutex, NULL);
-	if (r != 0)
-		fatal(r);
-	r = pthread_cond_init(&sbar->dirty_cond, NULL);
-	if (r != 0)
-		fatal(r);
 
-	/*
-	 * The signal for which each asynchronous component thread will wait
-	 * must be masked in all other threads.  This ensures that the signal
-	 * will never be delivered to any other thread.  We set the mask here
-	 * since all threads inherit their signal mask from their creator.
-	 */
-	if (sigemptyset(&sigset) < 0) {
+	sbar->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sbar->epfd < 0)
 		fatal(errno);
-	}
+	sbar->sigwatch.handle = signal_handle;
+	sbar->sigwatch.fd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sbar->sigwatch.fd < 0)
+		fatal(errno);
+	sbar_watch(sbar, &sbar->sigwatch);
+	sbar->wake.handle = wake_handle;
+	sbar->wake.fd = sbar->wakefd;
+	sbar_watch(sbar, &sbar->wake);
+	sbar->frame_timer.handle = frame_timer_handle;
+	sbar->frame_timer.fd = timerfd_create(CLOCK_MONOTONIC,
+					      TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sbar->frame_timer.fd < 0)
+		fatal(errno);
+	sbar_watch(sbar, &sbar->frame_timer);
+	sbar_create_display_watch(sbar);
+	sbar_create_timers(sbar);
+	sbar_create_sched(sbar);
+	sbar_create_notifiers(sbar);
+	sbar_create_streams(sbar);
+	sbar_create_ctl(sbar);
+	sbar_create_clicks_watch(sbar);
+	sbar_create_pool(sbar);
+	sbar->quit_sig = 0;
 
-	/* Create the components */
-	for (unsigned i = 0; i < ncomponents; i++) {
-		cp = &sbar->components[i];
+	sbar_update_all(sbar);
 
-		cp->id = i;
-		cp->buf = sbar->comp_bufs + ((size_t)MAX_COMP_LEN * i);
-		static_assert(sizeof(no_val_str) <= MAX_COMP_LEN,
-			      "no_val_str too large");
-		memcpy(cp->buf, no_val_str, sizeof(no_val_str));
-		cp->update = comp_defns[i].update;
-		cp->args = comp_defns[i].args;
-		cp->interval = comp_defns[i].interval;
-		cp->signum = comp_defns[i].signum;
-		if (cp->signum >= 0) {
-			/* We assume ‘signum’ specifies an offset into the
-			   real-time signal numbers and adjust it
-			   accordingly. */
-			cp->signum += SIGRTMIN;
-			if (sigaddset(&sigset, cp->signum) < 0) {
-				fatal(errno);
-			}
+	while (!sbar->quit_sig) {
+		if (atomic_load(&sbar->pending)) {
+			due = sbar_frame_due(sbar);
+			if (due > now_ns())
+				frame_timer_arm(sbar, due);
+			else
+				sbar_flush_output(sbar);
+		}
+		n = epoll_wait(sbar->epfd, events, LEN(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal(errno);
+		}
+		sbar_woke(sbar);
+		for (int i = 0; i < n; i++) {
+			Watch *w = events[i].data.ptr;
+			w->handle(sbar, w);
 		}
-		cp->sbar = sbar;
 	}
-	r = pthread_sigmask(SIG_BLOCK, &sigset, NULL);
-	assert(!r);
+
+	return sbar->quit_sig;
 }
+#endif
 
-static void sbar_start(StatusBar *sbar)
+/*
+ * Replay a recorded trace: run each update with the reads that were made
+ * during it, and output the status wherever it was output.  With a ‘speed’
+ * of 0 this is done as fast as possible, and otherwise at that multiple of
+ * the recorded pace.
+ */
+static void sbar_replay(StatusBar *sbar, const double speed)
 {
-	pthread_attr_t attr;
-	pthread_t tid;
-	Component *c;
+	struct timespec deadline;
+	int64_t start = now_ns(), t0 = -1, at;
+	TraceEvent ev;
 	int r;
 
-	r = pthread_attr_init(&attr);
-	if (r)
-		fatal(r);
-	r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (r)
-		fatal(r);
-	r = pthread_create(&sbar->thread, &attr, thread_flush, sbar);
-	if (r)
-		fatal(r);
-
-	for (uint8_t i = 0; i < sbar->ncomponents; i++) {
-		c = &sbar->components[i];
-		r = pthread_create(&tid, &attr, thread_once, c);
-		if (r)
-			fatal(r);
-		if (c->interval >= 0) {
-			r = pthread_create(&c->thr_repeating, &attr,
-					   thread_repeating, c);
-			if (r)
-				fatal(r);
-		}
-		if (c->signum >= 0) {
-			r = pthread_create(&c->thr_async, &attr, thread_async,
-					   c);
-			if (r)
-				fatal(r);
+	while (trace_next(&ev)) {
+		if (speed > 0) {
+			if (t0 < 0)
+				t0 = ev.t_ns;
+			at = start + (int64_t)((double)(ev.t_ns - t0) / speed);
+			deadline.tv_sec = at / 1000000000;
+			deadline.tv_nsec = at % 1000000000;
+			while ((r = clock_nanosleep(CLOCK_MONOTONIC,
+						    TIMER_ABSTIME, &deadline,
+						    NULL)) == EINTR)
+				;
+			assert(r == 0);
 		}
+		if (ev.kind == TRACE_FRAME)
+			sbar_flush_output(sbar);
+		else if (ev.comp >= sbar->ncomponents)
+			continue;
+		else if (ev.kind == TRACE_EXPIRE)
+			sbar_comp_expire(&sbar->components[ev.comp]);
+		else if (ev.kind == TRACE_STALE)
+			comp_job_overdue(&sbar->components[ev.comp].job,
+					 ev.value);
+		else
+			sbar_comp_update_with(&sbar->components[ev.comp],
+					      ev.args);
 	}
 }
 
 static void usage(FILE *f)
 {
 	assert(f != NULL);
-	(void)fputs("Usage: mtstatus [-h] [-s]\n", f);
+	(void)fputs("Usage: mtstatus [-h] [-s | -j] "
+		    "[-r dir | -p dir [-x speed]]\n",
+		    f);
 	(void)fputs("  -h        Print this help message and exit\n", f);
 	(void)fputs("  -s        Output to stdout\n", f);
+	(void)fputs("  -j        Output to stdout in the i3bar protocol, and\n"
+		    "            refresh components that are clicked\n",
+		    f);
+	(void)fputs("  -r dir    Record everything read to a trace in dir\n",
+		    f);
+	(void)fputs("  -p dir    Replay the trace in dir, then exit\n", f);
+	(void)fputs("  -x speed  Replay at speed times the recorded pace\n"
+		    "            (default: as fast as possible)\n",
+		    f);
+	(void)fputs("Send SIGUSR1 to print statistics of the components, or use\n"
+		    "mtstatusctl to control a running instance\n",
+		    f);
 }
 
 int main(int argc, char *argv[])
 {
 	StatusBar sbar;
+	const char *record_dir = NULL, *replay_dir = NULL;
+	double speed = 0;
+	char *end;
 
 	int option;
-	while ((option = getopt(argc, argv, "hs")) != -1) {
+	while ((option = getopt(argc, argv, "hsjr:p:x:")) != -1) {
 		switch (option) {
 		case 'h':
 			usage(stdout);
@@ -321,32 +2351,78 @@ int main(int argc, char *argv[])
 		case 's':
 			to_stdout = true;
 			break;
+		case 'j':
+			to_stdout = true;
+			to_json = true;
+			break;
+		case 'r':
+			record_dir = optarg;
+			break;
+		case 'p':
+			replay_dir = optarg;
+			break;
+		case 'x':
+			speed = strtod(optarg, &end);
+			if (*end || speed < 0) {
+				usage(stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			usage(stderr);
 			exit(EXIT_FAILURE);
 		}
 	}
+	if (record_dir && replay_dir) {
+		usage(stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (record_dir && !trace_record_open(record_dir, N_COMPONENTS)) {
+		log_errno(errno, "mtstatus: unable to record to '%s'",
+			  record_dir);
+		exit(EXIT_FAILURE);
+	}
+	if (replay_dir && !trace_replay_open(replay_dir, N_COMPONENTS)) {
+		log_errno(errno, "mtstatus: unable to replay '%s'",
+			  replay_dir);
+		exit(EXIT_FAILURE);
+	}
 
 	if (!to_stdout) {
-		/* Save the pid to a file so it’s available to shell commands */
+		/* Save the pid to a file so it’s available to shell commands.
+		   It goes next to the control socket, out of the reach of
+		   other users, and is never written through a symlink */
+		char name[MAX_COMP_LEN];
 		FILE *f;
-		int n = snprintf(pidfile, sizeof(pidfile), "/tmp/%s.pid",
-				 basename(argv[0]));
-		assert(n >= 0 && (size_t)n < sizeof(pidfile));
-		f = fopen(pidfile, "w");
-		if (!f)
-			fatal(errno);
+		int fd, n = snprintf(name, sizeof(name), "%s.pid",
+				     basename(argv[0]));
+		assert(n >= 0 && (size_t)n < sizeof(name));
+		if (!ctl_path(pidfile, sizeof(pidfile), name)) {
+			log_errno(errno, "mtstatus: pid file path");
+			exit(EXIT_FAILURE);
+		}
+		fd = open(pidfile, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+					   O_CLOEXEC,
+			  0644);
+		if (fd < 0 || !(f = fdopen(fd, "w"))) {
+			log_errno(errno, "mtstatus: unable to write '%s'",
+				  pidfile);
+			exit(EXIT_FAILURE);
+		}
 		if (fprintf(f, "%ld", (long)getpid()) < 0) {
 			fatal(errno);
 		}
 		(void)fclose(f);
 
-		dpy = XOpenDisplay(NULL);
-		if (!dpy)
-			fatal(errno);
+		if (!display_open()) {
+			log_err("mtstatus: unable to open display");
+			(void)remove(pidfile);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	/* SIGINT and SIGTERM must be delivered only to the initial thread */
+	/* SIGINT, SIGTERM and SIGUSR1 (which dumps the statistics of the
+	   components) must be delivered only to the initial thread */
 	sigset_t sigset;
 	if (sigemptyset(&sigset) < 0)
 		fatal(errno);
@@ -354,35 +2430,48 @@ int main(int argc, char *argv[])
 		fatal(errno);
 	if (sigaddset(&sigset, SIGTERM) < 0)
 		fatal(errno);
+	if (sigaddset(&sigset, SIGUSR1) < 0)
+		fatal(errno);
 	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-	/* Start the status bar */
 	sbar_create(&sbar, N_COMPONENTS, component_defns);
-	sbar_start(&sbar);
-
-	/* Wait for SIGINT, SIGTERM */
-	int sig, r;
-	r = sigwait(&sigset, &sig);
-	if (r == -1)
-		fatal(r);
+	if (to_json) {
+		static const char header[] =
+			"{\"version\":1,\"click_events\":true}\n[\n";
+		if (write(STDOUT_FILENO, header, sizeof(header) - 1) < 0)
+			fatal(errno);
+	}
+	if (replay_dir) {
+		sbar_replay(&sbar, speed);
+	} else {
+		/* Run the status bar until SIGINT or SIGTERM */
+		int sig = sbar_run(&sbar, &sigset);
+		/* Keep the i3bar protocol on stdout well-formed */
+		FILE *f = to_json ? stderr : stdout;
 
-	switch (sig) {
-	case SIGINT:
-		puts("SIGINT received.\n");
-		break;
-	case SIGTERM:
-		puts("SIGTERM received.\n");
-		break;
-	default:
-		puts("Unexpected signal received.\n");
+		switch (sig) {
+		case SIGINT:
+			(void)fputs("SIGINT received.\n\n", f);
+			break;
+		case SIGTERM:
+			(void)fputs("SIGTERM received.\n\n", f);
+			break;
+		default:
+			(void)fputs("Unexpected signal received.\n\n", f);
+		}
 	}
+	sbar_teardown(&sbar);
+	trace_close();
+	if (*ctl_sock && unlink(ctl_sock) < 0)
+		log_errno(errno, "Unable to remove %s", ctl_sock);
 
 	if (!to_stdout) {
-		XStoreName(dpy, DefaultRootWindow(dpy), NULL);
-		XCloseDisplay(dpy);
+		display_set_name(NULL);
+		display_close();
 
 		if (remove(pidfile) < 0) {
 			log_err("Unable to remove %s", pidfile);
 		}
 	}
+	return EXIT_SUCCESS;
 }
@@ -1,9 +1,6 @@
 #ifndef MTSTATUS_H
 #define MTSTATUS_H
 
-#include <X11/Xlib.h>
-
-extern Display *dpy;
 extern const char err_str[];
 
 #endif
@@ -0,0 +1,207 @@
+/*
+ * Client for the control socket of mtstatus (see ctl.h).  Sends the command
+ * given on the command line and prints the reply; with -b, instead times
+ * round trips of the command, and with -S as well the signal path that the
+ * socket replaces.
+ */
+#include "ctl.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static void die(const char *what)
+{
+	(void)fprintf(stderr, "mtstatusctl: %s: %s\n", what, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		die("clock_gettime");
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int ctl_connect(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!ctl_addr(&addr))
+		die("socket path");
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		die(addr.sun_path);
+	return fd;
+}
+
+/*
+ * Send ‘req’ and receive the reply into ‘reply’, NUL-terminated.
+ */
+static void ctl_request(int fd, const char *req, size_t len, char *reply)
+{
+	ssize_t n;
+
+	if (send(fd, req, len, MSG_NOSIGNAL) < 0)
+		die("send");
+	do {
+		n = recv(fd, reply, CTL_MAX_MSG - 1, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		die("recv");
+	if (n == 0) {
+		errno = ECONNRESET;
+		die("recv");
+	}
+	reply[n] = '\0';
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(const char *name, int64_t *lat, unsigned n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_i64);
+	printf("%-8s %10.1f %10.1f %10.1f\n", name, (double)lat[n / 2] / 1e3,
+	       (double)lat[(size_t)n * 99 / 100] / 1e3,
+	       (double)lat[n - 1] / 1e3);
+}
+
+/*
+ * Time ‘n’ round trips of ‘req’ and, if ‘sig’ is not negative, ‘n’ runs of
+ * the command a window manager would otherwise run to send SIGRTMIN+‘sig’.
+ * The signal path has no reply, so only the time to send is measured; the
+ * update it causes comes on top.
+ */
+static void bench(int fd, const char *req, size_t len, unsigned n, int sig)
+{
+	char reply[CTL_MAX_MSG], cmd[128 + PATH_MAX], pidfile[PATH_MAX];
+	char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+	int64_t *lat, t;
+	int status;
+	pid_t pid;
+
+	lat = calloc(n, sizeof(*lat));
+	if (!lat)
+		die("calloc");
+	printf("%-8s %10s %10s %10s\n", "path", "p50 us", "p99 us", "max us");
+
+	for (unsigned k = 0; k < n; k++) {
+		t = now_ns();
+		ctl_request(fd, req, len, reply);
+		lat[k] = now_ns() - t;
+	}
+	if (strncmp(reply, CTL_OK, strlen(CTL_OK)) != 0)
+		(void)fputs(reply, stderr);
+	report("socket", lat, n);
+
+	if (sig >= 0) {
+		if (!ctl_path(pidfile, sizeof(pidfile), "mtstatus.pid"))
+			die("pid file path");
+		(void)snprintf(cmd, sizeof(cmd), "kill -s RTMIN+%d $(cat '%s')",
+			       sig, pidfile);
+		for (unsigned k = 0; k < n; k++) {
+			t = now_ns();
+			errno = posix_spawn(&pid, argv[0], NULL, NULL, argv,
+					    environ);
+			if (errno)
+				die("posix_spawn");
+			if (waitpid(pid, &status, 0) < 0)
+				die("waitpid");
+			lat[k] = now_ns() - t;
+		}
+		report("signal", lat, n);
+	}
+	free(lat);
+}
+
+static void usage(FILE *f)
+{
+	(void)fputs("Usage: mtstatusctl [-h] [-b n [-S signal]] command "
+		    "[component]\n",
+		    f);
+	(void)fputs("  -h         Print this help message and exit\n", f);
+	(void)fputs("  -b n       Time n round trips of the command\n", f);
+	(void)fputs("  -S signal  Also time n runs of 'kill -s RTMIN+signal'\n",
+		    f);
+	(void)fputs("Commands: refresh [component], pause, resume, "
+		    "get [component], stats\n",
+		    f);
+}
+
+int main(int argc, char *argv[])
+{
+	char req[CTL_MAX_MSG], reply[CTL_MAX_MSG];
+	char *p = req, *const end = req + sizeof(req);
+	unsigned n = 0;
+	int sig = -1, option, fd;
+	size_t len;
+
+	while ((option = getopt(argc, argv, "hb:S:")) != -1) {
+		switch (option) {
+		case 'h':
+			usage(stdout);
+			exit(EXIT_SUCCESS);
+		case 'b':
+			n = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			sig = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind == argc || (sig >= 0 && n == 0)) {
+		usage(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Join the arguments into one command */
+	for (int i = optind; i < argc; i++) {
+		len = strlen(argv[i]);
+		if ((size_t)(end - p) < len + 1) {
+			errno = E2BIG;
+			die("command");
+		}
+		memcpy(p, argv[i], len);
+		p += len;
+		*p++ = i < argc - 1 ? ' ' : '\0';
+	}
+	len = (size_t)(p - req - 1);
+
+	fd = ctl_connect();
+	if (n > 0) {
+		bench(fd, req, len, n, sig);
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+	ctl_request(fd, req, len, reply);
+	close(fd);
+	if (strncmp(reply, CTL_OK, strlen(CTL_OK)) != 0) {
+		(void)fprintf(stderr, "mtstatusctl: %s", reply);
+		return EXIT_FAILURE;
+	}
+	(void)fputs(reply + strlen(CTL_OK), stdout);
+	return EXIT_SUCCESS;
+}
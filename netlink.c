@@ -0,0 +1,315 @@
+#include "netlink.h"
+
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A link dump younger than this is shared by every component updated on
+   the same tick */
+#define DUMP_MAX_AGE_NS 100000000L
+
+static NlLink *links;  // every link of the last dump, grown as needed
+static size_t nlinks, links_size;
+static bool links_valid;
+static struct timespec links_time;
+static pthread_mutex_t links_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int route_fd = -1, monitor_fd = -1, uevent_fd = -1;
+static uint32_t route_seq;
+
+static union {
+	struct nlmsghdr nh;
+	char buf[32768];
+} msg;
+
+/*
+ * Add the link in ‘nh’ to the cached links.  Returns false if there is no
+ * memory for it.
+ */
+static bool link_parse(const struct nlmsghdr *nh)
+{
+	const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	const struct rtattr *rta;
+	struct rtnl_link_stats64 stats;
+	int len = (int)IFLA_PAYLOAD(nh);
+	NlLink *link;
+	bool named = false;
+
+	if (nlinks == links_size) {
+		const size_t size = links_size ? links_size * 2 : 32;
+
+		link = realloc(links, size * sizeof(*links));
+		if (!link)
+			return false;
+		links = link;
+		links_size = size;
+	}
+	link = &links[nlinks];
+	memset(link, 0, sizeof(*link));
+	link->flags = ifi->ifi_flags;
+
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			if (RTA_PAYLOAD(rta) > sizeof(link->name))
+				break;
+			memcpy(link->name, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			link->name[sizeof(link->name) - 1] = '\0';
+			named = true;
+			break;
+		case IFLA_STATS64:
+			if (RTA_PAYLOAD(rta) < sizeof(stats))
+				break;
+			memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+			link->rx_bytes = stats.rx_bytes;
+			link->tx_bytes = stats.tx_bytes;
+			break;
+		default:
+			break;
+		}
+	}
+	if (named)
+		nlinks++;
+	return true;
+}
+
+/*
+ * Replace the cached links with a fresh RTM_GETLINK dump of every
+ * interface.
+ */
+static bool links_dump(void)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req = {
+		.nh = {
+			.nlmsg_len = sizeof(req),
+			.nlmsg_type = RTM_GETLINK,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+			.nlmsg_seq = ++route_seq,
+		},
+		.ifi = { .ifi_family = AF_UNSPEC },
+	};
+	const struct nlmsghdr *nh;
+	const struct nlmsgerr *err;
+	ssize_t n;
+	int len;
+
+	if (route_fd < 0) {
+		route_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+				  NETLINK_ROUTE);
+		if (route_fd < 0)
+			return false;
+	}
+	if (send(route_fd, &req, sizeof(req), 0) < 0)
+		return false;
+
+	nlinks = 0;
+	while (true) {
+		n = recv(route_fd, msg.buf, sizeof(msg.buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		len = (int)n;
+		for (nh = &msg.nh; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			/* Skip what is left of an earlier, abandoned dump */
+			if (nh->nlmsg_seq != route_seq)
+				continue;
+			switch (nh->nlmsg_type) {
+			case NLMSG_DONE:
+				return true;
+			case NLMSG_ERROR:
+				err = NLMSG_DATA(nh);
+				errno = -err->error;
+				return false;
+			case RTM_NEWLINK:
+				if (!link_parse(nh)) {
+					errno = ENOMEM;
+					return false;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static bool link_get(const char *name, NlLink *link)
+{
+	struct timespec now;
+	bool found = false;
+	int r, err = ENODEV;
+
+	r = pthread_mutex_lock(&links_mtx);
+	assert(r == 0);
+
+	r = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(r == 0);
+	if (!links_valid ||
+	    (now.tv_sec - links_time.tv_sec) * 1000000000L +
+			    (now.tv_nsec - links_time.tv_nsec) >
+		    DUMP_MAX_AGE_NS) {
+		links_valid = links_dump();
+		links_time = now;
+		if (!links_valid)
+			err = errno;
+	}
+	for (size_t i = 0; links_valid && i < nlinks && !found; i++) {
+		if (strcmp(links[i].name, name) == 0) {
+			*link = links[i];
+			found = true;
+		}
+	}
+
+	r = pthread_mutex_unlock(&links_mtx);
+	assert(r == 0);
+	if (!found)
+		errno = err;
+	return found;
+}
+
+/*
+ * Get the flags and byte counters of the interface called ‘name’.  All
+ * components updated on the same tick share a single dump.
+ */
+bool nl_link_get(const char *name, NlLink *link)
+{
+	bool found;
+
+	if (trace_mode == TRACE_REPLAY)
+		return trace_replay_io(TRACE_LINK, name, link, sizeof(*link)) >
+		       0;
+	found = link_get(name, link);
+	trace_io(TRACE_LINK, name, link, found ? sizeof(*link) : 0, found);
+	return found;
+}
+
+/*
+ * Return a descriptor that becomes readable whenever a link is added,
+ * removed, renamed or changes state.  The descriptor is shared by all
+ * callers.
+ */
+int nl_link_monitor(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	int fd;
+
+	if (monitor_fd >= 0)
+		return monitor_fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	monitor_fd = fd;
+	return fd;
+}
+
+/*
+ * Consume the pending link notifications and invalidate the cached dump.
+ * Returns whether there were any.
+ */
+bool nl_link_drain(const int fd)
+{
+	char buf[4096];
+	bool changed = false;
+	ssize_t n;
+	int r;
+
+	/* The messages are not inspected: the next dump reflects them */
+	while ((n = recv(fd, buf, sizeof(buf), MSG_TRUNC)) > 0 ||
+	       (n < 0 && (errno == EINTR || errno == ENOBUFS)))
+		changed = true;
+
+	if (changed) {
+		r = pthread_mutex_lock(&links_mtx);
+		assert(r == 0);
+		links_valid = false;
+		r = pthread_mutex_unlock(&links_mtx);
+		assert(r == 0);
+	}
+	return changed;
+}
+
+/*
+ * Return a descriptor that receives the kernel's device uevents.  The
+ * descriptor is shared by all callers.
+ */
+int nl_uevent_monitor(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,	 // kernel events, as opposed to udev's
+	};
+	int fd;
+
+	if (uevent_fd >= 0)
+		return uevent_fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	uevent_fd = fd;
+	return fd;
+}
+
+/*
+ * Consume the pending uevents and return whether any of them concerned a
+ * device in ‘subsystem’.  Each uevent is an "action@devpath" header
+ * followed by NUL-terminated KEY=value pairs.
+ */
+bool nl_uevent_drain(const int fd, const char *subsystem)
+{
+	char buf[8192], key[64];
+	const char *p, *end;
+	bool match = false;
+	ssize_t n;
+	int len;
+
+	len = snprintf(key, sizeof(key), "SUBSYSTEM=%s", subsystem);
+	assert(len > 0 && (size_t)len < sizeof(key));
+
+	while (true) {
+		n = recv(fd, buf, sizeof(buf) - 1, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* On overrun, events were lost: assume a match */
+			if (errno == ENOBUFS)
+				match = true;
+			break;
+		}
+		buf[n] = '\0';
+		for (p = buf, end = buf + n; p < end && !match;
+		     p += strlen(p) + 1)
+			match = strcmp(p, key) == 0;
+	}
+	return match;
+}
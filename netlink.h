@@ -0,0 +1,21 @@
+#ifndef NETLINK_H
+#define NETLINK_H
+
+#include <linux/if.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+	char name[IFNAMSIZ];
+	unsigned flags;	 // IFF_* flags
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+} NlLink;
+
+bool nl_link_get(const char *name, NlLink *link);
+int nl_link_monitor(void);
+bool nl_link_drain(int fd);
+int nl_uevent_monitor(void);
+bool nl_uevent_drain(int fd, const char *subsystem);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Scanners for the line-oriented text of procfs files.  They work in place
+ * on a NUL-terminated buffer, never modify it and never allocate.
+ */
+
+#include "parse.h"
+
+#include <stdbool.h>
+
+static bool is_space(const char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static bool is_digit(const char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static const char *skip_space(const char *p)
+{
+	while (is_space(*p))
+		p++;
+	return p;
+}
+
+/*
+ * Return a pointer to the text following ‘key’ on the first line of ‘buf’
+ * that starts with ‘key’, ignoring leading blanks, or NULL if there is no
+ * such line.
+ */
+const char *parse_line(const char *buf, const char *key)
+{
+	const char *p = buf, *k;
+
+	while (*p) {
+		p = skip_space(p);
+		for (k = key; *k && *p == *k; k++, p++)
+			;
+		if (!*k)
+			return p;
+		while (*p && *p != '\n')
+			p++;
+		if (*p)
+			p++;
+	}
+	return NULL;
+}
+
+/*
+ * Return a pointer to the start of the nth (1-based) blank-separated field
+ * of ‘line’, or NULL if the line has fewer fields.
+ */
+const char *parse_field(const char *line, int n)
+{
+	const char *p = skip_space(line);
+
+	while (--n > 0) {
+		while (*p && *p != '\n' && !is_space(*p))
+			p++;
+		p = skip_space(p);
+	}
+	return (*p && *p != '\n') ? p : NULL;
+}
+
+/*
+ * Parse a decimal number after any leading blanks into ‘val’, returning a
+ * pointer to the first character after it, or NULL if there is no number.
+ */
+const char *parse_u64(const char *p, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	p = skip_space(p);
+	if (!is_digit(*p))
+		return NULL;
+	while (is_digit(*p))
+		v = v * 10 + (uint64_t)(*p++ - '0');
+	*val = v;
+	return p;
+}
+
+/*
+ * Parse up to ‘n’ consecutive blank-separated numbers into ‘vals’,
+ * returning how many were parsed.
+ */
+size_t parse_u64s(const char *p, uint64_t *vals, const size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		p = parse_u64(p, &vals[i]);
+		if (!p)
+			break;
+	}
+	return i;
+}
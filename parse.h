@@ -0,0 +1,12 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+const char *parse_line(const char *buf, const char *key);
+const char *parse_field(const char *line, int n);
+const char *parse_u64(const char *p, uint64_t *val);
+size_t parse_u64s(const char *p, uint64_t *vals, size_t n);
+
+#endif
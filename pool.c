@@ -0,0 +1,244 @@
+/*
+ * A bounded pool of threads for work that may block, such as reading a
+ * file system that has stopped responding.  Whatever the number of jobs,
+ * the pool has ‘nthreads’ workers and a watchdog, and no memory beyond the
+ * Pool itself.
+ */
+
+#include "pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+enum { RUNQ, TIMERS };
+
+enum {
+	JOB_IDLE,
+	JOB_QUEUED,
+	JOB_RUNNING,
+};
+
+#define NO_IDX UINT_MAX
+
+static int64_t pool_now(void)
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pool_lock(Pool *p)
+{
+	int r = pthread_mutex_lock(&p->mtx);
+	assert(r == 0);
+}
+
+static void pool_unlock(Pool *p)
+{
+	int r = pthread_mutex_unlock(&p->mtx);
+	assert(r == 0);
+}
+
+static void heap_set(Pool *p, const unsigned h, const unsigned i, PoolJob *j)
+{
+	p->heap[h][i] = j;
+	j->idx[h] = i;
+}
+
+static void sift_up(Pool *p, const unsigned h, unsigned i)
+{
+	PoolJob *const j = p->heap[h][i];
+	unsigned parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (p->heap[h][parent]->deadline <= j->deadline)
+			break;
+		heap_set(p, h, i, p->heap[h][parent]);
+		i = parent;
+	}
+	heap_set(p, h, i, j);
+}
+
+static void sift_down(Pool *p, const unsigned h, unsigned i)
+{
+	PoolJob *const j = p->heap[h][i];
+	const unsigned n = p->len[h];
+	unsigned child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && p->heap[h][child + 1]->deadline <
+					     p->heap[h][child]->deadline)
+			child++;
+		if (j->deadline <= p->heap[h][child]->deadline)
+			break;
+		heap_set(p, h, i, p->heap[h][child]);
+		i = child;
+	}
+	heap_set(p, h, i, j);
+}
+
+static void heap_push(Pool *p, const unsigned h, PoolJob *j)
+{
+	const unsigned i = p->len[h]++;
+
+	assert(i < POOL_MAX_JOBS);
+	heap_set(p, h, i, j);
+	sift_up(p, h, i);
+}
+
+static void heap_remove(Pool *p, const unsigned h, PoolJob *j)
+{
+	const unsigned i = j->idx[h], last = --p->len[h];
+	PoolJob *moved;
+
+	j->idx[h] = NO_IDX;
+	if (i == last)
+		return;
+	moved = p->heap[h][last];
+	heap_set(p, h, i, moved);
+	sift_up(p, h, i);
+	sift_down(p, h, moved->idx[h]);
+}
+
+/* Queue ‘j’ to run within its budget from now.  Called with the lock held */
+static void pool_queue(Pool *p, PoolJob *j)
+{
+	int r;
+
+	j->state = JOB_QUEUED;
+	j->deadline = pool_now() + j->budget_ns;
+	heap_push(p, RUNQ, j);
+	heap_push(p, TIMERS, j);
+	r = pthread_cond_signal(&p->work);
+	assert(r == 0);
+	if (p->heap[TIMERS][0] == j) {
+		r = pthread_cond_signal(&p->timer);
+		assert(r == 0);
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	Pool *p = arg;
+	PoolJob *j;
+	int r;
+
+	pool_lock(p);
+	while (true) {
+		while (!p->len[RUNQ]) {
+			r = pthread_cond_wait(&p->work, &p->mtx);
+			assert(r == 0);
+		}
+		j = p->heap[RUNQ][0];
+		heap_remove(p, RUNQ, j);
+		j->state = JOB_RUNNING;
+		pool_unlock(p);
+
+		j->run(j);
+
+		pool_lock(p);
+		if (j->idx[TIMERS] != NO_IDX)
+			heap_remove(p, TIMERS, j);
+		else
+			j->overdue(j, false);
+		j->state = JOB_IDLE;
+		if (j->again) {
+			j->again = false;
+			pool_queue(p, j);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sleep until the earliest deadline, and report each job that is still
+ * queued or running when its deadline passes.
+ */
+static void *pool_watchdog(void *arg)
+{
+	Pool *p = arg;
+	struct timespec ts;
+	PoolJob *j;
+	int r;
+
+	pool_lock(p);
+	while (true) {
+		if (!p->len[TIMERS]) {
+			r = pthread_cond_wait(&p->timer, &p->mtx);
+			assert(r == 0);
+			continue;
+		}
+		j = p->heap[TIMERS][0];
+		if (j->deadline <= pool_now()) {
+			heap_remove(p, TIMERS, j);
+			j->overdue(j, true);
+			continue;
+		}
+		ts.tv_sec = j->deadline / 1000000000;
+		ts.tv_nsec = j->deadline % 1000000000;
+		r = pthread_cond_timedwait(&p->timer, &p->mtx, &ts);
+		assert(r == 0 || r == ETIMEDOUT);
+	}
+	return NULL;
+}
+
+/*
+ * Start ‘nthreads’ workers and the watchdog.  Returns 0, or an error number
+ * if a thread could not be created.
+ */
+int pool_start(Pool *p, unsigned nthreads)
+{
+	pthread_condattr_t attr;
+	pthread_t tid;
+	int r;
+
+	assert(nthreads > 0 && nthreads <= POOL_MAX_THREADS);
+	p->len[RUNQ] = p->len[TIMERS] = 0;
+	p->nthreads = nthreads;
+	if ((r = pthread_mutex_init(&p->mtx, NULL)) ||
+	    (r = pthread_cond_init(&p->work, NULL)) ||
+	    (r = pthread_condattr_init(&attr)))
+		return r;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (!r)
+		r = pthread_cond_init(&p->timer, &attr);
+	(void)pthread_condattr_destroy(&attr);
+	if (r)
+		return r;
+
+	for (unsigned i = 0; i <= nthreads; i++) {
+		r = pthread_create(&tid, NULL,
+				   i < nthreads ? pool_worker : pool_watchdog,
+				   p);
+		if (!r)
+			r = pthread_detach(tid);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * Queue ‘j’ to run within its budget from now, and return whether it was
+ * queued.  A job that is already queued is left as it is.  A job that is
+ * running, e.g. stuck in a call that has not returned, is queued again
+ * once it returns, so that the submission is not lost; it is never in the
+ * pool more than once.
+ */
+bool pool_submit(Pool *p, PoolJob *j)
+{
+	bool queued;
+
+	pool_lock(p);
+	queued = j->state == JOB_IDLE;
+	if (queued)
+		pool_queue(p, j);
+	else if (j->state == JOB_RUNNING)
+		j->again = true;
+	pool_unlock(p);
+	return queued;
+}
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Jobs that can be outstanding at once, i.e. one for each component */
+#define POOL_MAX_JOBS 256
+#define POOL_MAX_THREADS 16
+
+typedef struct pool_job PoolJob;
+
+/*
+ * A unit of work that may block, run on one of the pool's threads and
+ * expected to return within ‘budget_ns’ of being submitted.  If it has not,
+ * ‘overdue’ is called with true, and with false once it does return.  Both
+ * calls are made with the pool's lock held, so that they are never
+ * reordered, and must not block.
+ */
+struct pool_job {
+	void (*run)(PoolJob *j);
+	void (*overdue)(PoolJob *j, bool overdue);
+	int64_t budget_ns;
+	/* Owned by the pool */
+	int64_t deadline;  // CLOCK_MONOTONIC time by which ‘run’ should return
+	unsigned state;
+	bool again;	   // submitted while running, to be queued on return
+	unsigned idx[2];  // positions in the pool's heaps
+};
+
+/*
+ * A fixed set of threads that run jobs earliest deadline first.  Jobs are
+ * kept in two heaps ordered by deadline: the run queue of jobs waiting for
+ * a thread, and the timers of jobs, queued or running, whose deadline is
+ * yet to pass, on which a watchdog thread sleeps.  A job is in the pool at
+ * most once, so its memory is bounded by POOL_MAX_JOBS.
+ */
+typedef struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t work;   // a job was queued
+	pthread_cond_t timer;  // the earliest deadline may have changed
+	PoolJob *heap[2][POOL_MAX_JOBS];
+	unsigned len[2];
+	unsigned nthreads;
+} Pool;
+
+int pool_start(Pool *p, unsigned nthreads);
+bool pool_submit(Pool *p, PoolJob *j);
+
+#endif
@@ -0,0 +1,440 @@
+#include "trace.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC   "mtstrace"
+#define TRACE_VERSION 3
+
+/*
+ * A trace is a header followed by records.  Each record is followed by
+ * its key, NUL-terminated, and then its data.  Integers are in host byte
+ * order: traces are meant to be replayed on the machine type that
+ * recorded them.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t ncomponents;
+} TraceHeader;
+
+typedef struct {
+	int64_t t_ns;	  // CLOCK_MONOTONIC time of the record
+	int64_t ret;	  // return value of the read
+	int32_t err;	  // errno after the read
+	uint16_t kind;	  // TraceKind
+	uint16_t comp;	  // component being updated
+	uint32_t keylen;  // including the NUL
+	uint32_t len;	  // length of the data
+} TraceRecord;
+
+TraceMode trace_mode = TRACE_OFF;
+
+/*
+ * When recording, the records of an update are kept by the thread making
+ * it, and appended to the trace together when it ends, so that the reads
+ * of concurrent updates are not interleaved.  The lock is only held while
+ * appending: an update, or a change made outside of one, holds it from
+ * appending its records until its text is published, and a flush holds it
+ * until its frame is appended, so that a frame records exactly the updates
+ * and changes that it shows.
+ */
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static _Thread_local bool in_update;
+static _Thread_local unsigned cur_comp;
+static _Thread_local char *pending;  // the records of the current update
+static _Thread_local size_t pending_len, pending_size;
+static _Thread_local bool pending_lost;	 // a record could not be kept
+
+/* When replaying, the whole trace is held in memory */
+static char *trace_buf;
+static size_t trace_size;
+static size_t trace_pos;  // next update or frame
+static size_t io_pos;	  // next read of the update being replayed
+static bool io_diverged;
+
+static void trace_lock(void)
+{
+	int r = pthread_mutex_lock(&trace_mtx);
+	assert(r == 0);
+}
+
+static void trace_unlock(void)
+{
+	int r = pthread_mutex_unlock(&trace_mtx);
+	assert(r == 0);
+}
+
+static int64_t trace_now(void)
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+	return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static bool trace_path(char *path, size_t size, const char *dir)
+{
+	int n = snprintf(path, size, "%s/trace", dir);
+
+	if (n < 0 || (size_t)n >= size) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Start recording to the file ‘trace’ in the directory ‘dir’, which is
+ * created if need be.
+ */
+bool trace_record_open(const char *dir, unsigned ncomponents)
+{
+	TraceHeader hdr = { .version = TRACE_VERSION,
+			    .ncomponents = ncomponents };
+	char path[PATH_MAX];
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return false;
+	if (!trace_path(path, sizeof(path), dir))
+		return false;
+	trace_file = fopen(path, "we");
+	if (!trace_file)
+		return false;
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1) {
+		(void)fclose(trace_file);
+		trace_file = NULL;
+		return false;
+	}
+	trace_mode = TRACE_RECORD;
+	return true;
+}
+
+/*
+ * Load the trace recorded in the directory ‘dir’ for replay.
+ */
+bool trace_replay_open(const char *dir, unsigned ncomponents)
+{
+	char path[PATH_MAX];
+	TraceHeader hdr;
+	struct stat st;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if (!trace_path(path, sizeof(path), dir))
+		return false;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || !(trace_buf = malloc((size_t)st.st_size))) {
+		close(fd);
+		return false;
+	}
+	while (len < (size_t)st.st_size) {
+		n = read(fd, trace_buf + len, (size_t)st.st_size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += (size_t)n;
+	}
+	close(fd);
+	trace_size = len;
+
+	if (trace_size < sizeof(hdr)) {
+		log_err("Trace '%s' is truncated", path);
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(&hdr, trace_buf, sizeof(hdr));
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TRACE_VERSION) {
+		log_err("'%s' is not a trace of this version", path);
+		errno = EINVAL;
+		return false;
+	}
+	if (hdr.ncomponents != ncomponents) {
+		log_err("Trace '%s' has %u components, but config.h has %u",
+			path, hdr.ncomponents, ncomponents);
+		errno = EINVAL;
+		return false;
+	}
+	trace_pos = sizeof(hdr);
+	trace_mode = TRACE_REPLAY;
+	return true;
+}
+
+void trace_close(void)
+{
+	if (trace_file && fclose(trace_file) == EOF)
+		log_errno(errno, "Unable to write trace");
+	trace_file = NULL;
+	free(pending);
+	pending = NULL;
+	pending_len = pending_size = 0;
+	free(trace_buf);
+	trace_buf = NULL;
+	trace_mode = TRACE_OFF;
+}
+
+static TraceRecord record_make(TraceKind kind, size_t keylen, size_t len,
+			       int64_t ret, int err)
+{
+	return (TraceRecord){ .t_ns = trace_now(),
+			      .ret = ret,
+			      .err = err,
+			      .kind = (uint16_t)kind,
+			      .comp = (uint16_t)cur_comp,
+			      .keylen = (uint32_t)keylen,
+			      .len = (uint32_t)len };
+}
+
+/* Called with the lock held */
+static void file_write(const void *data, size_t len)
+{
+	if (!trace_file || !len)
+		return;
+	if (fwrite(data, len, 1, trace_file) != 1) {
+		log_errno(errno, "Unable to write trace; recording stopped");
+		(void)fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+static bool pending_add(const void *data, size_t len)
+{
+	size_t size = pending_size ? pending_size : 4096;
+	char *p;
+
+	while (size - pending_len < len)
+		size *= 2;
+	if (size != pending_size) {
+		p = realloc(pending, size);
+		if (!p)
+			return false;
+		pending = p;
+		pending_size = size;
+	}
+	memcpy(pending + pending_len, data, len);
+	pending_len += len;
+	return true;
+}
+
+/* Add a record to those of the current update */
+static void record_write(TraceKind kind, const char *key, const void *data,
+			 size_t len, int64_t ret, int err)
+{
+	const size_t keylen = strlen(key) + 1;
+	const TraceRecord rec = record_make(kind, keylen, len, ret, err);
+
+	if (pending_lost)
+		return;
+	pending_lost = !pending_add(&rec, sizeof(rec)) ||
+		       !pending_add(key, keylen) ||
+		       (len && !pending_add(data, len));
+}
+
+void trace_update_begin(unsigned comp, const char *args)
+{
+	if (trace_mode != TRACE_RECORD)
+		return;
+	in_update = true;
+	cur_comp = comp;
+	pending_len = 0;
+	pending_lost = false;
+	record_write(TRACE_UPDATE, args ? args : "", NULL, 0, 0, 0);
+}
+
+/*
+ * Append the records of the update to the trace.  The trace stays locked
+ * until trace_update_end(), which the update must call once it has
+ * published its text.
+ */
+void trace_update_commit(void)
+{
+	if (trace_mode != TRACE_RECORD)
+		return;
+	record_write(TRACE_END, "", NULL, 0, 0, 0);
+	in_update = false;
+	trace_lock();
+	if (pending_lost && trace_file) {
+		log_errno(ENOMEM, "Unable to record update; recording stopped");
+		(void)fclose(trace_file);
+		trace_file = NULL;
+	}
+	file_write(pending, pending_len);
+}
+
+void trace_update_end(void)
+{
+	if (trace_mode == TRACE_RECORD)
+		trace_unlock();
+}
+
+/*
+ * Append a change of how component ‘comp’ is shown that is not made by an
+ * update, such as the expiry of pushed text or the component becoming
+ * stale, with ‘value’ as its outcome.  As with an update, the trace stays
+ * locked until trace_update_end(), once the change is published.
+ */
+void trace_change_commit(TraceKind kind, unsigned comp, int64_t value)
+{
+	TraceRecord rec;
+
+	if (trace_mode != TRACE_RECORD)
+		return;
+	rec = record_make(kind, 1, 0, value, 0);
+	rec.comp = (uint16_t)comp;
+	trace_lock();
+	file_write(&rec, sizeof(rec));
+	file_write("", 1);
+}
+
+void trace_frame_begin(void)
+{
+	if (trace_mode == TRACE_RECORD)
+		trace_lock();
+}
+
+/*
+ * End a flush, which is recorded as a frame if the status changed and is
+ * to be output.
+ */
+void trace_frame_end(bool output)
+{
+	const TraceRecord rec = record_make(TRACE_FRAME, 1, 0, 0, 0);
+
+	if (trace_mode != TRACE_RECORD)
+		return;
+	if (output) {
+		file_write(&rec, sizeof(rec));
+		file_write("", 1);
+		/* Keep what has been recorded if we are killed */
+		if (trace_file && fflush(trace_file) == EOF)
+			log_errno(errno, "Unable to write trace");
+	}
+	trace_unlock();
+}
+
+/*
+ * Record that a read of ‘key’ returned ‘ret’ and the ‘len’ bytes at
+ * ‘data’, along with errno.  Reads made outside of an update, e.g. while
+ * draining notifications, are not recorded.
+ */
+void trace_io(TraceKind kind, const char *key, const void *data, size_t len,
+	      int64_t ret)
+{
+	const int err = errno;
+
+	if (trace_mode != TRACE_RECORD || !in_update)
+		return;
+	record_write(kind, key, data, len, ret, err);
+	errno = err;
+}
+
+/*
+ * Return the record at ‘pos’, its key and its data, or false if the trace
+ * ends before the record does (e.g. recording was killed mid-write).
+ */
+static bool record_at(size_t pos, TraceRecord *rec, const char **key,
+		      const char **data)
+{
+	if (pos > trace_size || trace_size - pos < sizeof(*rec))
+		return false;
+	memcpy(rec, trace_buf + pos, sizeof(*rec));
+	if (trace_size - pos - sizeof(*rec) < (size_t)rec->keylen + rec->len ||
+	    rec->keylen == 0 ||
+	    trace_buf[pos + sizeof(*rec) + rec->keylen - 1] != '\0')
+		return false;
+	*key = trace_buf + pos + sizeof(*rec);
+	*data = *key + rec->keylen;
+	return true;
+}
+
+static size_t record_next(size_t pos, const TraceRecord *rec)
+{
+	return pos + sizeof(*rec) + rec->keylen + rec->len;
+}
+
+/*
+ * Get the next update, change or frame to replay.  After an update is
+ * returned, trace_replay_io() serves the reads that were made during it.
+ */
+bool trace_next(TraceEvent *ev)
+{
+	const char *key, *data;
+	TraceRecord rec;
+	size_t pos;
+
+	while (record_at(trace_pos, &rec, &key, &data)) {
+		pos = trace_pos;
+		trace_pos = record_next(trace_pos, &rec);
+		if (rec.kind == TRACE_FRAME || rec.kind == TRACE_EXPIRE ||
+		    rec.kind == TRACE_STALE) {
+			*ev = (TraceEvent){ .kind = rec.kind,
+					    .comp = rec.comp,
+					    .value = rec.ret,
+					    .t_ns = rec.t_ns };
+			return true;
+		}
+		if (rec.kind != TRACE_UPDATE)
+			continue;
+
+		*ev = (TraceEvent){ .kind = TRACE_UPDATE,
+				    .comp = rec.comp,
+				    .args = key,
+				    .t_ns = rec.t_ns };
+		io_pos = trace_pos;
+		io_diverged = false;
+		/* Continue after the end of this update */
+		while (record_at(trace_pos, &rec, &key, &data)) {
+			trace_pos = record_next(trace_pos, &rec);
+			if (rec.kind == TRACE_END)
+				return true;
+		}
+		/* The update was cut short by the end of the trace */
+		trace_pos = pos;
+		return false;
+	}
+	return false;
+}
+
+/*
+ * Replay the next read of the current update, which must be of ‘kind’ and
+ * ‘key’: copy up to ‘size’ bytes of what it returned into ‘data’, set errno
+ * and return its return value.  If the update now reads something else,
+ * the replay has diverged from the recording, and the read fails with EIO.
+ */
+int64_t trace_replay_io(TraceKind kind, const char *key, void *data,
+			size_t size)
+{
+	const char *rkey, *rdata;
+	TraceRecord rec;
+
+	if (!record_at(io_pos, &rec, &rkey, &rdata) || rec.kind != kind ||
+	    strcmp(rkey, key) != 0) {
+		if (!io_diverged)
+			log_err("Replay diverged at read of '%s'", key);
+		io_diverged = true;
+		errno = EIO;
+		return -1;
+	}
+	io_pos = record_next(io_pos, &rec);
+	memcpy(data, rdata, rec.len < size ? rec.len : size);
+	errno = rec.err;
+	return rec.ret;
+}
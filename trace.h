@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recording of everything the components read, so that a session can be
+ * replayed later with the same results.  Each source of input calls
+ * trace_io() with what it read when recording, and trace_replay_io() in
+ * place of reading when replaying.
+ */
+
+typedef enum {
+	TRACE_OFF,
+	TRACE_RECORD,
+	TRACE_REPLAY,
+} TraceMode;
+
+typedef enum {
+	TRACE_UPDATE,	// a component update begins; key is its args
+	TRACE_END,	// the update ends
+	TRACE_FRAME,	// the status was output
+	TRACE_SOURCE,	// util_source_read()
+	TRACE_COMMAND,	// util_run_cmd()
+	TRACE_STATVFS,	// util_statvfs()
+	TRACE_LINK,	// nl_link_get()
+	TRACE_TIME,	// util_local_time()
+	TRACE_DIR,	// util_dir_list()
+	TRACE_KEYBOARD, // display_keyboard_get()
+	TRACE_CLOCK,	// util_monotonic_ns()
+	TRACE_EXPIRE,	// the pushed text of a component expired
+	TRACE_STALE,	// a component became stale (1) or not (0)
+} TraceKind;
+
+/* An update, change or frame to be replayed */
+typedef struct {
+	TraceKind kind;
+	unsigned comp;
+	const char *args;
+	int64_t value;  // of a change
+	int64_t t_ns;
+} TraceEvent;
+
+extern TraceMode trace_mode;
+
+bool trace_record_open(const char *dir, unsigned ncomponents);
+bool trace_replay_open(const char *dir, unsigned ncomponents);
+void trace_close(void);
+
+void trace_update_begin(unsigned comp, const char *args);
+void trace_update_commit(void);
+void trace_update_end(void);
+void trace_change_commit(TraceKind kind, unsigned comp, int64_t value);
+void trace_frame_begin(void);
+void trace_frame_end(bool output);
+void trace_io(TraceKind kind, const char *key, const void *data, size_t len,
+	      int64_t ret);
+
+bool trace_next(TraceEvent *ev);
+int64_t trace_replay_io(TraceKind kind, const char *key, void *data,
+			size_t size);
+
+#endif
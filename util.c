@@ -1,63 +1,291 @@
 #include "util.h"
 
+#include "trace.h"
+
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/pidfd.h>
+#include <sys/statvfs.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-bool util_file_get_line(char **buffer, size_t *restrict buffer_len,
-			const char *restrict target, const char *restrict path)
+/* Maximum number of source files kept open by util_source_read() */
+#define MAX_SOURCES 32
+
+/*
+ * A procfs or sysfs file kept open so that it can be re-read with pread()
+ * on every update.  A reader claims the source while it reads, so that the
+ * table lock is never held across I/O that may block.
+ */
+typedef struct {
+	char path[128];
+	int fd;
+	bool busy;  // claimed by a reader
+} Source;
+
+/* Maximum number of children awaiting reaping */
+#define MAX_CHILDREN 16
+
+static Source sources[MAX_SOURCES];
+static pthread_mutex_t sources_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* pidfds of children passed to util_reap() but not yet reaped */
+static int children[MAX_CHILDREN];
+static size_t nchildren;
+static pthread_mutex_t children_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Read the file from offset 0 into buf, NUL-terminate it and return the
+ * number of bytes read.  procfs and sysfs regenerate their contents on every
+ * read from offset 0, and a short read means end of file.
+ */
+static ssize_t pread_all(const int fd, char *buf, const size_t bufsize)
 {
-	FILE *restrict file;
-	bool return_val = false;
+	size_t len = 0;
+	ssize_t n;
 
-	file = fopen(path, "r");
-	if (!file) {
-		char msg[64];
-		sprintf(msg, "Error: unable to open '%s'", path);
-		perror(msg);
-		return false;
+	while (len < bufsize - 1) {
+		n = pread(fd, buf + len, bufsize - 1 - len, (off_t)len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		len += (size_t)n;
+		if (n == 0 || len < bufsize - 1)
+			break;
 	}
+	buf[len] = '\0';
+	return (ssize_t)len;
+}
 
-	while (getline(buffer, buffer_len, file) != -1) {
-		*(strchrnul(*buffer, '\n')) = 0;  // remove trailing newline
-		if (strstr(*buffer, target) != NULL) {
-			return_val = true;
-			break;
+static ssize_t source_read(Source *src, char *buf, const size_t bufsize)
+{
+	ssize_t n = pread_all(src->fd, buf, bufsize);
+
+	if (n < 0 && (errno == ENODEV || errno == ESTALE)) {
+		/* The underlying device went away (e.g. a battery or NIC was
+		   unplugged); try again with a fresh descriptor. */
+		close(src->fd);
+		src->fd = open(src->path, O_RDONLY | O_CLOEXEC);
+		if (src->fd < 0)
+			return -1;
+		n = pread_all(src->fd, buf, bufsize);
+	}
+	return n;
+}
+
+static void sources_lock(void)
+{
+	int r = pthread_mutex_lock(&sources_mtx);
+	assert(r == 0);
+}
+
+static void sources_unlock(void)
+{
+	int r = pthread_mutex_unlock(&sources_mtx);
+	assert(r == 0);
+}
+
+/*
+ * Find the source of ‘path’, or a free slot for it, and claim it.  Returns
+ * NULL if the table is full, or if another reader has claimed the source,
+ * e.g. one stuck in a read of a hung file system.
+ */
+static Source *source_claim(const char *path)
+{
+	Source *src = NULL, *free_src = NULL;
+
+	sources_lock();
+	for (size_t i = 0; i < LEN(sources) && !src; i++) {
+		if (!sources[i].path[0]) {
+			if (!free_src)
+				free_src = &sources[i];
+		} else if (strcmp(sources[i].path, path) == 0) {
+			src = &sources[i];
 		}
 	}
+	if (!src && free_src && strlen(path) < sizeof(free_src->path)) {
+		src = free_src;
+		strcpy(src->path, path);
+		src->fd = -1;
+	}
+	if (src && src->busy)
+		src = NULL;
+	else if (src)
+		src->busy = true;
+	sources_unlock();
+	return src;
+}
+
+static ssize_t source_read_cached(const char *path, char *buf,
+				  const size_t bufsize)
+{
+	Source *src;
+	ssize_t n;
+	int fd, err;
+
+	assert(bufsize > 0);
+
+	src = source_claim(path);
+	if (!src) {
+		/* Fall back to an uncached read */
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		n = fd < 0 ? -1 : pread_all(fd, buf, bufsize);
+		err = errno;
+		if (fd >= 0)
+			close(fd);
+		errno = err;
+		return n;
+	}
 
-	fclose(file);
-	return return_val;
+	if (src->fd < 0)
+		src->fd = open(path, O_RDONLY | O_CLOEXEC);
+	n = src->fd < 0 ? -1 : source_read(src, buf, bufsize);
+	err = errno;
+
+	sources_lock();
+	src->busy = false;
+	sources_unlock();
+	errno = err;
+	return n;
 }
 
-bool util_string_get_nth_field(char *buffer, size_t buffer_size, char *string,
-			       const int n)
+/*
+ * Read the whole of the file at ‘path’ into ‘buf’ and NUL-terminate it,
+ * returning the number of bytes read or -1 with errno set.  The file is
+ * opened on first use and kept open, so that later reads cost a single
+ * pread().
+ */
+ssize_t util_source_read(const char *path, char *buf, const size_t bufsize)
 {
-	char *token;
-	size_t token_len;
-	int count = 1;
-	char *saveptr;
+	ssize_t n;
 
-	if (!string || n <= 0)
-		return NULL;
+	assert(bufsize > 0);
 
-	token = strtok_r(string, " ", &saveptr);
-	while (token != NULL && count < n) {
-		token = strtok_r(NULL, " ", &saveptr);
-		count++;
+	if (trace_mode == TRACE_REPLAY) {
+		n = trace_replay_io(TRACE_SOURCE, path, buf, bufsize);
+		buf[n < 0 ? 0 : bufsize - 1] = '\0';
+		return n;
 	}
-	if (count < n)
-		return false;
+	n = source_read_cached(path, buf, bufsize);
+	trace_io(TRACE_SOURCE, path, buf, n < 0 ? 0 : (size_t)n + 1, n);
+	return n;
+}
 
-	token_len = strlen(token);
-	assert(buffer_size >= token_len + 1);
-	memmove(buffer, token, token_len + 1);
-	return true;
+/*
+ * Store the names of the entries of the directory ‘path’, other than those
+ * starting with a dot, in ‘buf’, each followed by a newline, and
+ * NUL-terminate it.  Returns the length of the list, or -1 with errno set.
+ * Entries that do not fit are left out.
+ */
+ssize_t util_dir_list(const char *path, char *buf, const size_t bufsize)
+{
+	char dents[4096];
+	const struct dirent64 *de;
+	size_t len = 0, namelen;
+	ssize_t n;
+	int fd, err;
+
+	assert(bufsize > 0);
+
+	if (trace_mode == TRACE_REPLAY) {
+		n = trace_replay_io(TRACE_DIR, path, buf, bufsize);
+		buf[n < 0 ? 0 : bufsize - 1] = '\0';
+		return n;
+	}
+
+	/* Read the entries directly, so that listing costs no allocation */
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		trace_io(TRACE_DIR, path, NULL, 0, -1);
+		return -1;
+	}
+	while ((n = getdents64(fd, dents, sizeof(dents))) > 0) {
+		for (size_t off = 0; off < (size_t)n; off += de->d_reclen) {
+			de = (const struct dirent64 *)(dents + off);
+			namelen = strlen(de->d_name);
+			if (de->d_name[0] == '.' || len + namelen + 1 >= bufsize)
+				continue;
+			memcpy(buf + len, de->d_name, namelen);
+			len += namelen;
+			buf[len++] = '\n';
+		}
+	}
+	err = errno;
+	close(fd);
+	buf[len] = '\0';
+	errno = err;
+	n = n < 0 ? -1 : (ssize_t)len;
+	trace_io(TRACE_DIR, path, buf, n < 0 ? 0 : len + 1, n);
+	return n;
+}
+
+/*
+ * statvfs(), recorded and replayed with the other sources.
+ */
+int util_statvfs(const char *path, struct statvfs *fs)
+{
+	int r;
+
+	if (trace_mode == TRACE_REPLAY)
+		return (int)trace_replay_io(TRACE_STATVFS, path, fs,
+					    sizeof(*fs));
+	r = statvfs(path, fs);
+	trace_io(TRACE_STATVFS, path, fs, r < 0 ? 0 : sizeof(*fs), r);
+	return r;
+}
+
+/*
+ * Get the current local time, recorded and replayed with the other
+ * sources.
+ */
+bool util_local_time(struct tm *tm)
+{
+	struct timespec ts;
+	bool ok;
+
+	if (trace_mode == TRACE_REPLAY)
+		return trace_replay_io(TRACE_TIME, "", tm, sizeof(*tm)) > 0;
+
+	/* time() reads a coarse clock that can lag behind the timer that
+	   woke us on a minute boundary, so read the precise one */
+	ok = clock_gettime(CLOCK_REALTIME, &ts) == 0 &&
+	     localtime_r(&ts.tv_sec, tm) != NULL;
+	trace_io(TRACE_TIME, "", tm, ok ? sizeof(*tm) : 0, ok);
+	return ok;
+}
+
+/*
+ * Get the CLOCK_MONOTONIC time in ns, recorded and replayed with the other
+ * sources so that rates computed from it replay exactly.
+ */
+int64_t util_monotonic_ns(void)
+{
+	struct timespec ts;
+	int64_t t = 0;
+
+	if (trace_mode == TRACE_REPLAY) {
+		(void)trace_replay_io(TRACE_CLOCK, "", &t, sizeof(t));
+		return t;
+	}
+
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+	t = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	trace_io(TRACE_CLOCK, "", &t, sizeof(t), 0);
+	return t;
 }
 
 char *util_cat(char *dest, const char *end, const char *str)
@@ -67,6 +295,128 @@ char *util_cat(char *dest, const char *end, const char *str)
 	return dest;
 }
 
+/*
+ * Like util_cat(), but escape ‘str’ for use in a JSON string.  An escape
+ * that does not fit before ‘end’ is left out entirely.
+ */
+char *util_json_escape(char *dest, const char *end, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char ch;
+
+	for (; *str; str++) {
+		ch = (unsigned char)*str;
+		if (ch == '"' || ch == '\\') {
+			if (end - dest < 2)
+				break;
+			*dest++ = '\\';
+			*dest++ = (char)ch;
+		} else if (ch < 0x20) {
+			if (end - dest < 6)
+				break;
+			memcpy(dest, "\\u00", 4);
+			dest[4] = hex[ch >> 4];
+			dest[5] = hex[ch & 0xf];
+			dest += 6;
+		} else {
+			if (dest >= end)
+				break;
+			*dest++ = (char)ch;
+		}
+	}
+	return dest;
+}
+
+static const char *json_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Return the end of the string starting at ‘p’, or NULL if it has none */
+static const char *json_string_end(const char *p)
+{
+	for (p++; *p && *p != '"'; p++)
+		if (*p == '\\' && !*++p)
+			return NULL;
+	return *p ? p + 1 : NULL;
+}
+
+/* Return the end of the value starting at ‘p’, or NULL if it has none */
+static const char *json_value_end(const char *p)
+{
+	unsigned depth = 0;
+
+	if (*p == '"')
+		return json_string_end(p);
+	if (*p != '{' && *p != '[') {
+		/* A number, true, false or null */
+		while (*p && !strchr(",}] \t\r\n", *p))
+			p++;
+		return p;
+	}
+	while (*p) {
+		if (*p == '"') {
+			if (!(p = json_string_end(p)))
+				return NULL;
+			continue;
+		}
+		if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+			return p + 1;
+		p++;
+	}
+	return NULL;
+}
+
+/*
+ * Find the member ‘key’ of the JSON object ‘json’, without looking into
+ * the values of other members, and copy its value into ‘buf’: a string
+ * without its quotes, and not unescaped, and any other value as it is.
+ * Returns false if there is no such member, it does not fit in ‘buf’ or
+ * the object is malformed before it.
+ */
+bool util_json_get(const char *json, const char *key, char *buf,
+		   const size_t bufsize)
+{
+	const size_t keylen = strlen(key);
+	const char *p = json_space(json), *k, *v;
+	size_t len;
+
+	if (*p != '{')
+		return false;
+	for (p = json_space(p + 1); *p == '"'; p = json_space(p + 1)) {
+		k = p + 1;
+		if (!(p = json_string_end(p)))
+			return false;
+		len = (size_t)(p - 1 - k);
+		p = json_space(p);
+		if (*p != ':')
+			return false;
+		v = json_space(p + 1);
+		if (!(p = json_value_end(v)))
+			return false;
+		if (len == keylen && memcmp(k, key, len) == 0) {
+			if (*v == '"') {
+				v++;
+				p--;
+			}
+			len = (size_t)(p - v);
+			if (len >= bufsize)
+				return false;
+			memcpy(buf, v, len);
+			buf[len] = '\0';
+			return true;
+		}
+		p = json_space(p);
+		if (*p != ',')
+			return false;
+	}
+	return false;
+}
+
 int util_fmt_human(char *buf, size_t len, uintmax_t num, int base)
 {
 	double scaled;
@@ -111,64 +461,266 @@ static void argv_str(char *buf, const size_t bufsize, char *const argv[])
 	*p = '\0';
 }
 
-bool util_run_cmd(char *buf, const size_t bufsize, char *const argv[])
+/*
+ * Reap, without blocking, any children passed to util_reap() that have
+ * since exited.
+ */
+static void reap_children(void)
+{
+	siginfo_t si;
+	size_t i = 0;
+	int r;
+
+	r = pthread_mutex_lock(&children_mtx);
+	assert(r == 0);
+	while (i < nchildren) {
+		si.si_pid = 0;
+		if (waitid(P_PIDFD, (id_t)children[i], &si,
+			   WEXITED | WNOHANG) == 0 &&
+		    si.si_pid == 0) {
+			i++;  // still running
+			continue;
+		}
+		close(children[i]);
+		children[i] = children[--nchildren];
+	}
+	r = pthread_mutex_unlock(&children_mtx);
+	assert(r == 0);
+}
+
+/*
+ * Kill the child referred to by ‘pidfd’, if it is still running, and reap
+ * it without blocking.  The pidfd is closed.
+ */
+void util_reap(int pidfd)
+{
+	int r;
+
+	(void)pidfd_send_signal(pidfd, SIGKILL, NULL, 0);
+	reap_children();
+
+	r = pthread_mutex_lock(&children_mtx);
+	assert(r == 0);
+	if (nchildren < LEN(children)) {
+		children[nchildren++] = pidfd;
+		pidfd = -1;
+	}
+	r = pthread_mutex_unlock(&children_mtx);
+	assert(r == 0);
+
+	if (pidfd >= 0) {
+		/* No room to defer it; it has been killed, so this will not
+		   block for long. */
+		(void)waitid(P_PIDFD, (id_t)pidfd, NULL, WEXITED);
+		close(pidfd);
+	}
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Read whatever output is available without blocking.  Once ‘buf’ is full
+ * the rest is read and discarded, so that the child does not block on a
+ * full pipe.  Returns false on end of file.
+ */
+static bool read_output(const int fd, char *buf, size_t *len,
+			const size_t bufsize)
+{
+	char scratch[4096];
+	bool full;
+	ssize_t n;
+
+	while (true) {
+		full = *len == bufsize - 1;
+		n = full ? read(fd, scratch, sizeof(scratch))
+			 : read(fd, buf + *len, bufsize - 1 - *len);
+		if (n > 0) {
+			if (!full)
+				*len += (size_t)n;
+		} else if (n == 0 || errno != EINTR) {
+			return n < 0 && errno == EAGAIN;
+		}
+	}
+}
+
+/*
+ * Start the command ‘argv’ with its standard output connected to a pipe.
+ * Returns the non-blocking read end of the pipe, and stores a pidfd for the
+ * child in ‘pidfd’, or returns -1 on error.  The child is started with
+ * posix_spawn(), which does not copy our page tables.  Its standard input
+ * is /dev/null, as ours may be the click events that i3bar writes.
+ */
+int util_spawn(char *const argv[], int *pidfd)
 {
 	assert(argv[0] && "argv[0] must not be NULL");
 
-	int ret, status;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigset;
 	pid_t pid;
-	ssize_t nread;
-	char argv_s[bufsize];
-	int pipefd[2];
+	int pipefd[2], r;
+	char argv_s[256];
 
-	ret = pipe(pipefd);
-	if (ret == -1) {
+	argv_str(argv_s, sizeof(argv_s), argv);
+	reap_children();
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
 		log_errno(errno, "Error creating pipe");
-		return false;
+		return -1;
 	}
-
-	pid = fork();
-	switch (pid) {
-	case -1:
-		log_errno(errno, "Error: unable to fork");
+	if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) < 0) {
+		log_errno(errno, "Error setting O_NONBLOCK on pipe");
 		close(pipefd[0]);
 		close(pipefd[1]);
-		return false;
-	case 0:
-		ret = dup2(pipefd[1], 1);
-		if (ret < 0) {
-			log_errno(errno,
-				  "Error: unable to dup2 in child process");
-			_exit(EXIT_FAILURE);
-		}
-		execvp(argv[0], argv);
-		_exit(EXIT_FAILURE);  // Failed exec
-	default:
-		nread = read(pipefd[0], buf, bufsize);
-		assert(nread != -1);
-		buf[nread - 1] = '\0';	// Remove trailing newline
-		ret = waitpid(pid, &status, 0);
-		assert(ret != -1);
+		return -1;
+	}
+
+	/* The child must not inherit the signals we block for sigwait() and
+	   the signalfd */
+	(void)sigemptyset(&sigset);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &sigset);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+					 O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+
+	r = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(pipefd[1]);
+	if (r != 0) {
+		log_errno(r, "Error: unable to run '%s'", argv_s);
 		close(pipefd[0]);
-		close(pipefd[1]);
-		argv_str(argv_s, sizeof(argv_s), argv);
-		if (!WIFEXITED(status)) {
-			log_err("Error: command terminated abnormally: '%s'",
-				argv_s);
+		return -1;
+	}
+
+	*pidfd = pidfd_open(pid, 0);
+	if (*pidfd < 0) {
+		log_errno(errno, "Error: pidfd_open");
+		(void)kill(pid, SIGKILL);
+		(void)waitpid(pid, NULL, 0);
+		close(pipefd[0]);
+		return -1;
+	}
+	return pipefd[0];
+}
+
+static bool run_cmd(char *buf, const size_t bufsize, char *const argv[],
+		    const int timeout_ms)
+{
+
+	siginfo_t si = { 0 };
+	int fd, pidfd, r;
+	char argv_s[bufsize];
+	size_t len = 0;
+	int64_t deadline = now_ms() + timeout_ms, remaining;
+
+	argv_str(argv_s, sizeof(argv_s), argv);
+
+	fd = util_spawn(argv, &pidfd);
+	if (fd < 0)
+		return false;
+
+	struct pollfd pfds[] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = pidfd, .events = POLLIN },
+	};
+	while (!pfds[1].revents) {
+		remaining = deadline - now_ms();
+		if (remaining <= 0) {
+			log_err("Error: command timed out after %d ms: '%s'",
+				timeout_ms, argv_s);
+			util_reap(pidfd);
+			close(fd);
 			return false;
 		}
-		if (WEXITSTATUS(status)) {
-			log_err("Error: command exited with status %d: '%s'",
-				status, argv_s);
+		r = poll(pfds, LEN(pfds), (int)remaining);
+		if (r < 0 && errno != EINTR) {
+			log_errno(errno, "Error: poll");
+			util_reap(pidfd);
+			close(fd);
 			return false;
 		}
+		/* Stop watching the pipe on EOF */
+		if (r > 0 && pfds[0].revents &&
+		    !read_output(fd, buf, &len, bufsize))
+			pfds[0].fd = -1;
+	}
+	if (pfds[0].fd >= 0)
+		(void)read_output(fd, buf, &len, bufsize);
+	close(fd);
+
+	r = waitid(P_PIDFD, (id_t)pidfd, &si, WEXITED);
+	close(pidfd);
+	assert(r == 0);
+
+	buf[len] = '\0';
+	*strchrnul(buf, '\n') = '\0';
+
+	if (si.si_code != CLD_EXITED) {
+		log_err("Error: command terminated abnormally: '%s'", argv_s);
+		return false;
+	}
+	if (si.si_status) {
+		log_err("Error: command exited with status %d: '%s'",
+			si.si_status, argv_s);
+		return false;
 	}
 
 	return true;
 }
 
+/*
+ * Run the command ‘argv’ and store the first line of its output in ‘buf’.
+ * The child is killed if it has not exited within ‘timeout_ms’.
+ */
+bool util_run_cmd(char *buf, const size_t bufsize, char *const argv[],
+		  const int timeout_ms)
+{
+	char key[256];
+	bool ok;
+
+	assert(argv[0] && "argv[0] must not be NULL");
+	assert(bufsize > 0);
+
+	if (trace_mode == TRACE_OFF)
+		return run_cmd(buf, bufsize, argv, timeout_ms);
+
+	argv_str(key, sizeof(key), argv);
+	if (trace_mode == TRACE_REPLAY) {
+		ok = trace_replay_io(TRACE_COMMAND, key, buf, bufsize) > 0;
+		buf[ok ? bufsize - 1 : 0] = '\0';
+		return ok;
+	}
+	ok = run_cmd(buf, bufsize, argv, timeout_ms);
+	trace_io(TRACE_COMMAND, key, buf, ok ? strlen(buf) + 1 : 0, ok);
+	return ok;
+}
+
+/* Number of errors logged by this thread */
+static _Thread_local unsigned long nerrors;
+
+/*
+ * Return the number of errors logged by the calling thread, so that a
+ * caller can tell whether a call logged any.
+ */
+unsigned long util_error_count(void)
+{
+	return nerrors;
+}
+
 void log_err(const char *fmt, ...)
 {
+	nerrors++;
+
 	va_list ap;
 	va_start(ap, fmt);
 	(void)vfprintf(stderr, fmt, ap);
@@ -186,6 +738,6 @@ void log_errno(int errnum, const char *fmt, ...)
 	assert(n >= 0 && (size_t)n < sizeof(msg));
 	va_end(ap);
 
-	strerror_r(errnum, err, sizeof(err));
-	log_err("%s: %s", msg, err);
+	/* GNU strerror_r() may return a static string instead of filling err */
+	log_err("%s: %s", msg, strerror_r(errnum, err, sizeof(err)));
 }
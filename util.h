@@ -5,16 +5,29 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+struct statvfs;
+struct tm;
+
 #define LEN(x) (sizeof(x) / sizeof((x)[0]))
 
 #define K_SI  1000
 #define K_IEC 1024
 
-bool util_file_get_line(char **, size_t *, const char *, const char *);
-bool util_string_get_nth_field(char *, size_t, char *, int);
-bool util_run_cmd(char *buf, size_t bufsize, char *const argv[]);
+ssize_t util_source_read(const char *path, char *buf, size_t bufsize);
+ssize_t util_dir_list(const char *path, char *buf, size_t bufsize);
+int util_statvfs(const char *path, struct statvfs *fs);
+bool util_local_time(struct tm *tm);
+int64_t util_monotonic_ns(void);
+int util_spawn(char *const argv[], int *pidfd);
+void util_reap(int pidfd);
+bool util_run_cmd(char *buf, size_t bufsize, char *const argv[],
+		  int timeout_ms);
 int util_fmt_human(char *buf, size_t len, uintmax_t num, int base);
 char *util_cat(char *dest, const char *end, const char *str);
+char *util_json_escape(char *dest, const char *end, const char *str);
+bool util_json_get(const char *json, const char *key, char *buf,
+		   size_t bufsize);
+unsigned long util_error_count(void);
 void log_err(const char *fmt, ...);
 void log_errno(int errnum, const char *fmt, ...);
 